@@ -41,15 +41,19 @@ DEFINE_COLOR_TABLE_FUNCTION(blue)
 DEFINE_SIMPLE_STATE_FUNCTIONS(ColorTableState, colortbl)
 
 const ControlWord colortbl_word_table[] = {
-    { "red", REQUIRED_PARAMETER, TRUE, ct_red },
-    { "green", REQUIRED_PARAMETER, TRUE, ct_green },
-    { "blue", REQUIRED_PARAMETER, TRUE, ct_blue },
+    { "red", REQUIRED_PARAMETER, FLUSH_BUFFER, ct_red },
+    { "green", REQUIRED_PARAMETER, FLUSH_BUFFER, ct_green },
+    { "blue", REQUIRED_PARAMETER, FLUSH_BUFFER, ct_blue },
     { NULL }
 };
 
+static gsize colortbl_word_index = 0;
+
 const DestinationInfo colortbl_destination = {
     colortbl_word_table,
+    &colortbl_word_index,
     color_table_text,
+    sizeof(ColorTableState),
     colortbl_state_new,
     colortbl_state_copy,
     colortbl_state_free
@@ -64,7 +68,7 @@ color_table_text(ParserContext *ctx)
     if(strchr(ctx->text->str, ';'))
     {
         gchar *color = g_strdup_printf("#%02x%02x%02x", state->red, state->green, state->blue);
-        ctx->color_table = g_slist_append(ctx->color_table, color);
+        g_ptr_array_add(ctx->color_table, color);
         state->red = state->green = state->blue = 0;
     }
     g_string_truncate(ctx->text, 0);
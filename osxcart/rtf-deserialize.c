@@ -14,13 +14,18 @@ You should have received a copy of the GNU Lesser General Public License along
 with Osxcart.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <glib.h>
 #include <config.h>
 #include <glib/gi18n-lib.h>
 #include <gtk/gtk.h>
 #include <osxcart/rtf.h>
+#include "rtf-codepage.h"
 #include "rtf-document.h"
 #include "rtf-deserialize.h"
 #include "rtf-ignore.h"
@@ -48,111 +53,415 @@ words applies.
  * License: GPLv2
  */
 
+/* Converter from a codepage to UTF-8; either a built-in table for the most
+common single-byte codepages, or an iconv converter */
+struct _Converter {
+    const gunichar2 *table;
+    GIConv iconv;
+};
+
+/* Hash table of control words, built once per control word table so that
+looking up a control word doesn't depend on the size of the table. It uses open
+addressing with linear probing; 'mask' is the number of slots minus one, and the
+number of slots is a power of two at least twice the number of words. */
+struct _ControlWordIndex {
+    guint mask;
+    const ControlWord **slots;
+};
+
+/* FNV-1a hash of the first 'length' bytes of 'word', prefixed with '*' if
+'ignorable' is TRUE */
+static guint
+hash_control_word(gboolean ignorable, const gchar *word, gsize length)
+{
+    guint hash = 2166136261U;
+    gsize count;
+
+    if(ignorable)
+    {
+        hash ^= (guchar)'*';
+        hash *= 16777619U;
+    }
+    for(count = 0; count < length; count++)
+    {
+        hash ^= (guchar)word[count];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Returns the slot in which the control word 'word' of length 'length' is
+stored, or the empty slot where it would go if it is not in the index. Ignorable
+control words are stored with a '*' prefix. */
+static const ControlWord **
+find_control_word_slot(const ControlWordIndex *index, gboolean ignorable, const gchar *word, gsize length)
+{
+    guint slot = hash_control_word(ignorable, word, length) & index->mask;
+
+    while(index->slots[slot] != NULL)
+    {
+        const gchar *candidate = index->slots[slot]->word;
+        if(ignorable)
+        {
+            if(candidate[0] == '*' && strncmp(candidate + 1, word, length) == 0 && candidate[length + 1] == '\0')
+                break;
+        }
+        else if(strncmp(candidate, word, length) == 0 && candidate[length] == '\0')
+            break;
+        slot = (slot + 1) & index->mask;
+    }
+    return &index->slots[slot];
+}
+
+/* Build an index for the control word table 'word_table' */
+static ControlWordIndex *
+control_word_index_new(const ControlWord *word_table)
+{
+    ControlWordIndex *index;
+    const ControlWord *word;
+    guint size = 8, count = 0;
+
+    for(word = word_table; word->word != NULL; word++)
+        count++;
+    while(size < count * 2)
+        size <<= 1;
+
+    index = g_new(ControlWordIndex, 1);
+    index->mask = size - 1;
+    index->slots = g_new0(const ControlWord *, size);
+
+    for(word = word_table; word->word != NULL; word++)
+    {
+        const ControlWord **slot;
+        if(word->word[0] == '*')
+            slot = find_control_word_slot(index, TRUE, word->word + 1, strlen(word->word + 1));
+        else
+            slot = find_control_word_slot(index, FALSE, word->word, strlen(word->word));
+        /* If a word is listed twice, the first one wins, as it did when the
+        table was searched linearly */
+        if(*slot == NULL)
+            *slot = word;
+    }
+    return index;
+}
+
+/* Get the index for the control word table of 'destinfo', building it the first
+time the destination is used. After that, this only reads the pointer kept in
+the destination info. The indices are never freed, because the tables they
+index are static. */
+static const ControlWordIndex *
+get_control_word_index(const DestinationInfo *destinfo)
+{
+    if(g_once_init_enter(destinfo->word_index))
+        g_once_init_leave(destinfo->word_index, (gsize)control_word_index_new(destinfo->word_table));
+    return (const ControlWordIndex *)*destinfo->word_index;
+}
+
+/* Look up the control word 'word' of length 'length' in 'index'; returns NULL
+if it is not there */
+static const ControlWord *
+lookup_control_word(const ControlWordIndex *index, gboolean ignorable, const gchar *word, gsize length)
+{
+    return *find_control_word_slot(index, ignorable, word, length);
+}
+
+/* Free font properties */
+static void
+font_properties_free(FontProperties *fontprop)
+{
+    g_free(fontprop->font_name);
+    g_free(fontprop->family);
+    g_slice_free(FontProperties, fontprop);
+}
+
 /* Allocate a new parser context and initialize it with the main document
 destination */
 static ParserContext *
-parser_context_new(const gchar *rtftext, GtkTextBuffer *textbuffer, GtkTextIter *insert)
+parser_context_new(const gchar *rtftext, gsize length, GtkTextBuffer *textbuffer, GtkTextIter *insert, const RtfImportOptions *options)
 {
     ParserContext *ctx;
-    Destination *dest;
 
     g_assert(rtftext != NULL && textbuffer != NULL);
 
     ctx = g_slice_new0(ParserContext);
+    if(options)
+        ctx->options = *options;
+    ctx->picture_pixels_left = ctx->options.max_document_pixels;
     ctx->codepage = -1;
     ctx->default_codepage = 1252;
     ctx->default_font = -1;
     ctx->default_language = 1024;
     ctx->group_nesting_level = 0;
-    ctx->color_table = NULL;
-    ctx->font_table = NULL;
+    ctx->color_table = g_ptr_array_new();
+    ctx->font_table = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)font_properties_free);
     ctx->footnote_number = 1;
     ctx->rtftext = rtftext;
     ctx->pos = rtftext;
+    ctx->end = rtftext + length;
     ctx->convertbuffer = g_string_new("");
+    ctx->converters = g_hash_table_new(g_direct_hash, g_direct_equal);
     ctx->text = g_string_new("");
+    ctx->runs_text = g_string_new("");
+    ctx->runs = g_array_new(FALSE, FALSE, sizeof(TextRun));
 
     ctx->textbuffer = textbuffer;
     ctx->tags = gtk_text_buffer_get_tag_table(textbuffer);
+    ctx->tab_tags = g_hash_table_new_full((GHashFunc)tab_stops_hash, (GEqualFunc)tab_stops_equal, (GDestroyNotify)tab_stops_unref, (GDestroyNotify)g_object_unref);
+    if(ctx->options.merge_tags)
+    {
+        ctx->merged_tags = g_hash_table_new_full((GHashFunc)attributes_hash, (GEqualFunc)attributes_equal, (GDestroyNotify)attributes_free, NULL);
+        ctx->merged_tag_keys = g_hash_table_new(g_str_hash, g_str_equal);
+        gtk_text_tag_table_foreach(ctx->tags, (GtkTextTagTableForeach)index_merged_tag, ctx->merged_tag_keys);
+        ctx->style_attributes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)attributes_free);
+    }
     ctx->startmark = gtk_text_buffer_create_mark(textbuffer, NULL, insert, TRUE);
     ctx->endmark = gtk_text_buffer_create_mark(textbuffer, NULL, insert, FALSE);
 
-    dest = g_slice_new0(Destination);
-    dest->info = &document_destination;
-    dest->nesting_level = 0;
-    dest->state_stack = g_queue_new();
-    g_queue_push_head(dest->state_stack, dest->info->state_new());
-
-    ctx->destination_stack = g_queue_new();
-    g_queue_push_head(ctx->destination_stack, dest);
+    push_new_destination(ctx, &document_destination, NULL);
 
     return ctx;
 }
 
-/* Free font properties */
+/* Make room for one more state on the destination's state stack and return a
+pointer to it. The memory is reused from earlier destinations that occupied the
+same place on the destination stack, if possible, and is zeroed. Pointers to
+this destination's other states are invalidated. */
+static gpointer
+destination_push_state_memory(Destination *dest)
+{
+    gsize size = dest->info->state_size;
+    gsize needed = (dest->n_states + 1) * size;
+    gchar *state;
+
+    if(size == 0)
+    {
+        /* Destinations without state, such as the ignore destination */
+        dest->n_states++;
+        return NULL;
+    }
+
+    if(needed > dest->states_allocated)
+    {
+        dest->states_allocated = MAX(needed, dest->states_allocated * 2);
+        dest->states = g_realloc(dest->states, dest->states_allocated);
+    }
+    if(dest->n_states == dest->state_shares_allocated)
+    {
+        dest->state_shares_allocated = MAX(8, dest->state_shares_allocated * 2);
+        dest->state_shares = g_renew(guint, dest->state_shares, dest->state_shares_allocated);
+    }
+    state = dest->states + dest->n_states * size;
+    dest->state_shares[dest->n_states] = 0;
+    dest->n_states++;
+    memset(state, 0, size);
+    return state;
+}
+
+/* Enter a group in the current destination. The new group shares the state of
+the enclosing group; get_destination_state() makes a copy of it once the new
+group needs to change it. */
 static void
-font_properties_free(FontProperties *fontprop)
+destination_push_state(Destination *dest)
 {
-    g_free(fontprop->font_name);
-    g_slice_free(FontProperties, fontprop);
+    if(dest->info->state_size == 0)
+    {
+        dest->n_states++;
+        return;
+    }
+    g_assert(dest->n_states > 0);
+    dest->state_shares[dest->n_states - 1]++;
+}
+
+/* Leave a group in the current destination, freeing its state if it was not
+shared with the enclosing group */
+static void
+destination_pop_state(Destination *dest)
+{
+    g_assert(dest->n_states > 0);
+    if(dest->info->state_size != 0 && dest->state_shares[dest->n_states - 1] > 0)
+    {
+        dest->state_shares[dest->n_states - 1]--;
+        return;
+    }
+    dest->info->state_free(dest->states + (dest->n_states - 1) * dest->info->state_size);
+    dest->n_states--;
 }
 
 /* Push new destination onto the destination stack. If state_to_copy is not
 NULL, then initializes the state stack with a copy of that state, otherwise a
-blank state. */
+blank state. The destination stack is an array, whose entries keep their state
+stack memory when popped so that it can be reused; pointers to destinations are
+invalidated. */
 void
-push_new_destination(ParserContext *ctx, const DestinationInfo *destinfo, gpointer state_to_copy)
+push_new_destination(ParserContext *ctx, const DestinationInfo *destinfo, gconstpointer state_to_copy)
 {
-    Destination *dest = g_slice_new0(Destination);
+    Destination *dest;
+    gpointer state;
+
+    if(ctx->n_destinations == ctx->destinations_allocated)
+    {
+        guint old_allocated = ctx->destinations_allocated;
+        ctx->destinations_allocated = MAX(8, old_allocated * 2);
+        ctx->destinations = g_renew(Destination, ctx->destinations, ctx->destinations_allocated);
+        memset(ctx->destinations + old_allocated, 0, (ctx->destinations_allocated - old_allocated) * sizeof(Destination));
+    }
+    dest = ctx->destinations + ctx->n_destinations;
+    ctx->n_destinations++;
+
     dest->info = destinfo;
+    dest->word_index = get_control_word_index(destinfo);
     dest->nesting_level = ctx->group_nesting_level;
-    dest->state_stack = g_queue_new();
+    dest->n_states = 0;
+
+    state = destination_push_state_memory(dest);
     if(state_to_copy)
-        g_queue_push_head(dest->state_stack, dest->info->state_copy(state_to_copy));
+        dest->info->state_copy(state_to_copy, state);
     else
-        g_queue_push_head(dest->state_stack, dest->info->state_new());
-    g_queue_push_head(ctx->destination_stack, dest);
+        dest->info->state_new(state);
 }
 
-/* Free destination */
+/* Pop the current destination from the destination stack, freeing any states
+it has left */
 static void
-destination_free(Destination *dest)
+pop_destination(ParserContext *ctx)
 {
-    g_queue_foreach(dest->state_stack, (GFunc)dest->info->state_free, NULL);
-    g_queue_free(dest->state_stack);
-    g_slice_free(Destination, dest);
+    Destination *dest = get_destination(ctx, 0);
+
+    if(dest->info->state_size != 0)
+        while(dest->n_states > 0)
+        {
+            dest->state_shares[dest->n_states - 1] = 0;
+            destination_pop_state(dest);
+        }
+    dest->n_states = 0;
+    ctx->n_destinations--;
+}
+
+/* Free a converter from the converter cache, if it is not a placeholder for an
+unsupported codepage */
+static void
+converter_free(gpointer codepage, Converter *converter)
+{
+    if(converter == NULL)
+        return;
+    if(converter->iconv != (GIConv)-1)
+        g_iconv_close(converter->iconv);
+    g_slice_free(Converter, converter);
 }
 
 /* Free parser context */
 static void
 parser_context_free(ParserContext *ctx)
 {
+    guint count;
+
     g_assert(ctx != NULL);
     g_string_free(ctx->convertbuffer, FALSE);
+    g_hash_table_foreach(ctx->converters, (GHFunc)converter_free, NULL);
+    g_hash_table_destroy(ctx->converters);
 
-    g_slist_foreach(ctx->color_table, (GFunc)g_free, NULL);
-    g_slist_free(ctx->color_table);
+    g_ptr_array_foreach(ctx->color_table, (GFunc)g_free, NULL);
+    g_ptr_array_free(ctx->color_table, TRUE);
 
-    g_slist_foreach(ctx->font_table, (GFunc)font_properties_free, NULL);
-    g_slist_free(ctx->font_table);
+    g_hash_table_destroy(ctx->font_table);
 
-    g_queue_foreach(ctx->destination_stack, (GFunc)destination_free, NULL);
-    g_queue_free(ctx->destination_stack);
+    while(ctx->n_destinations > 0)
+        pop_destination(ctx);
+    for(count = 0; count < ctx->destinations_allocated; count++)
+    {
+        g_free(ctx->destinations[count].states);
+        g_free(ctx->destinations[count].state_shares);
+    }
+    g_free(ctx->destinations);
 
     gtk_text_buffer_delete_mark(ctx->textbuffer, ctx->startmark);
     gtk_text_buffer_delete_mark(ctx->textbuffer, ctx->endmark);
 
     g_string_free(ctx->text, TRUE);
+    g_string_free(ctx->runs_text, TRUE);
+    g_array_free(ctx->runs, TRUE);
+
+    for(count = 0; count < N_TAG_KINDS; count++)
+        if(ctx->tag_cache[count])
+            g_hash_table_destroy(ctx->tag_cache[count]);
+    g_hash_table_destroy(ctx->tab_tags);
+    if(ctx->merged_tags)
+        g_hash_table_destroy(ctx->merged_tags);
+    if(ctx->merged_tag_keys)
+        g_hash_table_destroy(ctx->merged_tag_keys);
+    if(ctx->style_attributes)
+        g_hash_table_destroy(ctx->style_attributes);
 
     g_slice_free(ParserContext, ctx);
 }
 
-/* Convenience function to get the current state of the current destination */
+/* Get the destination 'depth' places below the top of the destination stack;
+0 is the current destination */
+Destination *
+get_destination(ParserContext *ctx, guint depth)
+{
+    g_assert(depth < ctx->n_destinations);
+    return ctx->destinations + ctx->n_destinations - 1 - depth;
+}
+
+/* Get the topmost state of a destination for modifying it, or NULL if the
+destination has no state. If the state is still shared with the enclosing
+group, then the current group gets its own copy first. Pointers to this
+destination's other states are invalidated. */
+gpointer
+get_destination_state(Destination *dest)
+{
+    gsize size = dest->info->state_size;
+    gchar *state;
+
+    if(size == 0)
+        return NULL;
+    g_assert(dest->n_states > 0);
+    if(dest->state_shares[dest->n_states - 1] == 0)
+        return dest->states + (dest->n_states - 1) * size;
+
+    dest->state_shares[dest->n_states - 1]--;
+    /* Making room may move the state stack, so find the state to copy after
+    that; it is just below the new one */
+    state = destination_push_state_memory(dest);
+    dest->info->state_copy(state - size, state);
+    return state;
+}
+
+/* Get the topmost state of a destination for reading only, or NULL if the
+destination has no state. This never copies a shared state. */
+gconstpointer
+peek_destination_state(Destination *dest)
+{
+    if(dest->info->state_size == 0 || dest->n_states == 0)
+        return NULL;
+    return dest->states + (dest->n_states - 1) * dest->info->state_size;
+}
+
+/* Get the state that a destination started out with, at the bottom of its
+state stack. Changes to it are seen by any groups still sharing it. */
+gpointer
+get_destination_initial_state(Destination *dest)
+{
+    if(dest->info->state_size == 0 || dest->n_states == 0)
+        return NULL;
+    return dest->states;
+}
+
+/* Convenience function to get the current state of the current destination,
+for modifying it */
 gpointer
 get_state(ParserContext *ctx)
 {
-    Destination *dest = g_queue_peek_head(ctx->destination_stack);
-    return g_queue_peek_head(dest->state_stack);
+    return get_destination_state(get_destination(ctx, 0));
+}
+
+/* Convenience function to get the current state of the current destination,
+for reading only */
+gconstpointer
+peek_state(ParserContext *ctx)
+{
+    return peek_destination_state(get_destination(ctx, 0));
 }
 
 /* Returns properties for font numbered index in the font table, or NULL if such
@@ -160,21 +469,23 @@ font does not exist */
 FontProperties *
 get_font_properties(ParserContext *ctx, int index)
 {
-    unsigned i;
-    FontProperties *properties;
+    return g_hash_table_lookup(ctx->font_table, GINT_TO_POINTER(index));
+}
 
-    for (i = 0; i < g_slist_length(ctx->font_table); i++) {
-        properties = g_slist_nth_data(ctx->font_table, i);
-        if (properties != NULL && properties->index == index)
-            return properties;
-    }
-    return NULL;
+/* Returns the color numbered index in the color table, or NULL if such color
+does not exist */
+const gchar *
+get_color(ParserContext *ctx, int index)
+{
+    if(index < 0 || (guint)index >= ctx->color_table->len)
+        return NULL;
+    return g_ptr_array_index(ctx->color_table, index);
 }
 
-/* Return the name of a GIconv converter for the specified codepage, if it
-exists; otherwise NULL */
-static gchar *
-get_charset_for_codepage(int codepage)
+/* Open a GIConv converter from the specified codepage to UTF-8, if it exists;
+otherwise return (GIConv)-1 */
+static GIConv
+open_converter_for_codepage(int codepage)
 {
     GIConv converter;
     gchar *charset;
@@ -194,20 +505,13 @@ get_charset_for_codepage(int codepage)
         { 0, NULL }
     };
 
-    if(codepage == -1)
-        return NULL;
-
     /* First try the "CP<cpge>" charset */
     charset = g_strdup_printf("CP%i", codepage);
     converter = g_iconv_open("UTF-8", charset);
+    g_free(charset);
 
     if(converter != (GIConv)-1)
-    {
-        g_iconv_close(converter);
-        return charset;
-    }
-
-    g_free(charset);
+        return converter;
 
     /* If there is no such converter, try the hard-coded table */
     for(i = 0; ansicpgs[i].codepage != 0; i++)
@@ -216,119 +520,259 @@ get_charset_for_codepage(int codepage)
         {
             converter = g_iconv_open("UTF-8", ansicpgs[i].locale);
             if(converter != (GIConv)-1)
-            {
-                g_iconv_close(converter);
-                return g_strdup(ansicpgs[i].locale);
-            }
+                return converter;
         }
     }
-    return NULL;
+    return (GIConv)-1;
 }
 
-/* Convert the character ch to UTF-8 and add to the context's buffer */
-gboolean
+/* Return a converter from the specified codepage to UTF-8, or NULL if there is
+none. Built-in tables are preferred over iconv. Converters are opened only once
+per parse and cached in the parser context, as are failures to open them. */
+static Converter *
+get_converter_for_codepage(ParserContext *ctx, int codepage)
+{
+    gpointer cached;
+    Converter *converter = NULL;
+    const gunichar2 *table;
+    GIConv iconv;
+
+    if(codepage == -1)
+        return NULL;
+
+    if(g_hash_table_lookup_extended(ctx->converters, GINT_TO_POINTER(codepage), NULL, &cached))
+        return cached;
+
+    table = codepage_get_table(codepage);
+    iconv = (table == NULL)? open_converter_for_codepage(codepage) : (GIConv)-1;
+    if(table != NULL || iconv != (GIConv)-1)
+    {
+        converter = g_slice_new(Converter);
+        converter->table = table;
+        converter->iconv = iconv;
+    }
+    g_hash_table_insert(ctx->converters, GINT_TO_POINTER(codepage), converter);
+    return converter;
+}
+
+/* Convert 'length' bytes of 'text' to UTF-8 using 'converter' and append the
+result to 'output'. Illegal bytes are replaced by '?'. Returns the number of
+bytes at the end of 'text' which were not converted because they form an
+incomplete character. */
+static gsize
+convert_to_utf8(Converter *converter, const gchar *text, gsize length, GString *output)
+{
+    gchar *inbuf = (gchar *)text;
+    gsize inbytes_left = length;
+    gchar outbuf[256];
+
+    if(converter->table)
+    {
+        codepage_table_convert(converter->table, text, length, output);
+        return 0;
+    }
+
+    /* Reset the converter's shift state */
+    g_iconv(converter->iconv, NULL, NULL, NULL, NULL);
+
+    while(inbytes_left > 0)
+    {
+        gchar *outptr = outbuf;
+        gsize outbytes_left = sizeof(outbuf);
+        gsize result = g_iconv(converter->iconv, &inbuf, &inbytes_left, &outptr, &outbytes_left);
+
+        g_string_append_len(output, outbuf, outptr - outbuf);
+        if(result != (gsize)-1)
+            continue;
+
+        switch(errno)
+        {
+            case E2BIG:
+                /* Output buffer full, go around again */
+                break;
+            case EINVAL:
+                /* Incomplete character at the end of the input */
+                return inbytes_left;
+            case EILSEQ:
+                g_string_append_c(output, '?');
+                inbuf++;
+                inbytes_left--;
+                break;
+            default:
+                g_warning(_("Conversion error: %s"), g_strerror(errno));
+                return 0;
+        }
+    }
+    return 0;
+}
+
+/* Convert the bytes waiting in the context's convert buffer to UTF-8 and add
+them to the context's text buffer. Bytes at the end which form an incomplete
+character are left in the convert buffer, to be completed by the next bytes. */
+static void
+convert_pending_bytes(ParserContext *ctx)
+{
+    gsize leftover;
+
+    if(ctx->convertbuffer->len == 0)
+        return;
+    leftover = convert_to_utf8(ctx->converter, ctx->convertbuffer->str, ctx->convertbuffer->len, ctx->text);
+    g_string_erase(ctx->convertbuffer, 0, ctx->convertbuffer->len - leftover);
+}
+
+/* Add the character ch to the convert buffer, to be converted to UTF-8 and
+added to the context's text buffer along with the rest of the run of \'xx codes
+it is part of */
+static gboolean
 convert_hex_to_utf8(ParserContext *ctx, gchar ch, GError **error)
 {
-    gchar *text_to_convert, *converted_text, *charset;
+    Converter *converter;
     gint codepage = -1;
-    GError *converterror = NULL;
     Destination *dest;
 
+    /* A nul byte can't be part of the text */
+    if(ch == '\0')
+        return TRUE;
+
     /* Determine the character encoding that ch is in. First see if the current
     destination diverts us to another codepage (e.g., \fcharset in the \fonttbl
     destination) and if not, use either the current codepage or the default codepage. */
-    dest = (Destination *)g_queue_peek_head(ctx->destination_stack);
+    dest = get_destination(ctx, 0);
     codepage = -1;
     if(dest->info->get_codepage)
         codepage = dest->info->get_codepage(ctx);
     if(codepage == -1)
         codepage = ctx->codepage;
-    charset = get_charset_for_codepage(codepage);
-    if(charset == NULL)
-        charset = get_charset_for_codepage(ctx->default_codepage);
-    if(charset == NULL)
+    converter = get_converter_for_codepage(ctx, codepage);
+    if(converter == NULL)
+        converter = get_converter_for_codepage(ctx, ctx->default_codepage);
+    if(converter == NULL)
     {
         g_set_error(error, RTF_ERROR, RTF_ERROR_UNSUPPORTED_CHARSET, _("Character set %d is not supported"), (ctx->default_codepage == -1)? codepage : ctx->default_codepage);
         return FALSE;
     }
 
-    /* Now see if there was any incompletely converted text left over from
-    previous characters */
-    if(ctx->convertbuffer->len)
+    /* If the character set changed in the middle of a run, convert the bytes
+    that are already waiting. An incomplete character from the old character
+    set can't be completed in the new one, so discard it. */
+    if(ctx->convertbuffer->len && converter != ctx->converter)
     {
-        g_string_append_c(ctx->convertbuffer, ch);
-        text_to_convert = g_strdup(ctx->convertbuffer->str);
+        convert_pending_bytes(ctx);
         g_string_truncate(ctx->convertbuffer, 0);
     }
-    else
-        text_to_convert = g_strndup(&ch, 1);
 
-    converted_text = g_convert_with_fallback(text_to_convert, -1, "UTF-8", charset, "?", NULL, NULL, &converterror);
-    g_free(charset);
-    if(converterror)
+    ctx->converter = converter;
+    g_string_append_c(ctx->convertbuffer, ch);
+    return TRUE;
+}
+
+/* Returns TRUE if ch can't be part of a run of plain text: a group delimiter,
+backslash, newline, nul, or high character */
+#define IS_SPECIAL_CHARACTER(ch) \
+    ((ch) == '{' || (ch) == '}' || (ch) == '\\' || (ch) == '\n' || (ch) == '\r' \
+    || (ch) == '\0' || (guchar)(ch) >= 0x80)
+
+/* Returns TRUE if ch ends a run of RTF code handed straight to a destination:
+a group delimiter, backslash, or nul */
+#define IS_DELIMITER_CHARACTER(ch) \
+    ((ch) == '{' || (ch) == '}' || (ch) == '\\' || (ch) == '\0')
+
+/* Returns a pointer to the first special character (see above) at or after
+'pos', or 'end' if there is none. If 'delimiters_only' is TRUE, then newlines
+and high characters don't count, and the pointer is to the first delimiter
+character. */
+static const gchar *
+find_end_of_plain_text(const gchar *pos, const gchar *end, gboolean delimiters_only)
+{
+#ifdef __SSE2__
+    /* Look at 16 bytes at a time */
+    const __m128i open_brace = _mm_set1_epi8('{');
+    const __m128i close_brace = _mm_set1_epi8('}');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i carriage_return = _mm_set1_epi8('\r');
+    const __m128i nul = _mm_setzero_si128();
+
+    while(end - pos >= 16)
     {
-        /* If there is a "partial input" error, then save the text
-         in the convert buffer and retrieve it if there is another
-         consecutive \'xx code */
-        if(converterror->code == G_CONVERT_ERROR_PARTIAL_INPUT)
-            g_string_append(ctx->convertbuffer, text_to_convert);
+        __m128i chunk = _mm_loadu_si128((const __m128i *)pos);
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, open_brace), _mm_cmpeq_epi8(chunk, close_brace)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, backslash), _mm_cmpeq_epi8(chunk, nul)));
+        gint mask;
+
+        if(delimiters_only)
+            mask = _mm_movemask_epi8(special);
         else
-            g_warning(_("Conversion error: %s"), converterror->message);
-        g_clear_error(&converterror);
+        {
+            special = _mm_or_si128(special,
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, newline), _mm_cmpeq_epi8(chunk, carriage_return)));
+            /* High characters have their top bit set already */
+            mask = _mm_movemask_epi8(special) | _mm_movemask_epi8(chunk);
+        }
+        if(mask != 0)
+            return pos + g_bit_nth_lsf(mask, -1);
+        pos += 16;
     }
+#endif /* __SSE2__ */
+
+    if(delimiters_only)
+        while(pos < end && !IS_DELIMITER_CHARACTER(*pos))
+            pos++;
     else
-    {
-        g_string_append(ctx->text, converted_text);
-        g_free(converted_text);
-    }
-    g_free(text_to_convert);
-    return TRUE;
+        while(pos < end && !IS_SPECIAL_CHARACTER(*pos))
+            pos++;
+    return pos;
 }
 
-/* Parses a control word from the input buffer. 'word' is the return location
-for the control word, without a backslash, but with '*' prefixed if the control
-word is preceded by \*, which means that the control word represents a
+/* Parses a control word from the input buffer. 'word' and 'length' are the
+return locations for the control word, without a backslash; 'word' points into
+the input buffer and is not nul-terminated. 'ignorable' is set to TRUE if the
+control word is preceded by \*, which means that the control word represents a
 destination that should be skipped if it is not recognized.
  */
 static gboolean
-parse_control_word(ParserContext *ctx, gchar **word, GError **error)
+parse_control_word(ParserContext *ctx, const gchar **word, gsize *length, gboolean *ignorable, GError **error)
 {
     g_assert(ctx != NULL && *(ctx->pos) == '\\');
 
+    *ignorable = FALSE;
     ctx->pos++;
-    if(*ctx->pos == '*')
+    while(*ctx->pos == '*')
     {
         /* Ignorable destination */
-        gchar *destword;
-
+        *ignorable = TRUE;
         ctx->pos++;
         while(isspace(*ctx->pos))
             ctx->pos++;
-        if(!parse_control_word(ctx, &destword, error))
+        if(*ctx->pos != '\\')
+        {
+            g_set_error(error, RTF_ERROR, RTF_ERROR_INVALID_RTF, _("Backslash encountered without control word"));
             return FALSE;
-        *word = g_strconcat("*", destword, NULL);
-        g_free(destword);
+        }
+        ctx->pos++;
     }
-    else if(g_ascii_ispunct(*ctx->pos) || *ctx->pos == '\n' || *ctx->pos == '\r')
+
+    if(g_ascii_ispunct(*ctx->pos) || *ctx->pos == '\n' || *ctx->pos == '\r')
     {
         /* Control symbol */
-        *word = g_strndup(ctx->pos, 1);
+        *word = ctx->pos;
+        *length = 1;
         ctx->pos++;
     }
     else
     {
         /* Control word */
-        gsize length = 0;
-
-        while(g_ascii_isalpha(ctx->pos[length]))
-            length++;
-        if(length == 0)
+        *word = ctx->pos;
+        *length = 0;
+        while(g_ascii_isalpha(ctx->pos[*length]))
+            (*length)++;
+        if(*length == 0)
         {
             g_set_error(error, RTF_ERROR, RTF_ERROR_INVALID_RTF, _("Backslash encountered without control word"));
             return FALSE;
         }
-        *word = g_strndup(ctx->pos, length);
-        ctx->pos += length;
+        ctx->pos += *length;
     }
 
     return TRUE;
@@ -341,29 +785,36 @@ after parsing the number. */
 static gboolean
 parse_int_parameter(ParserContext *ctx, gint32 *value)
 {
-    gsize length = 0;
-    gchar *intstr;
+    gboolean negative = FALSE;
+    gint64 magnitude = 0;
 
     g_assert(ctx != NULL);
 
-    /* Don't use strtol() directly to convert the value, because it will
-    validate a '+' sign in front of the number, whereas that's not valid
-    according to the RTF spec */
-
-    /* Find the length of the integer */
+    /* Don't use strtol() to convert the value, because it will validate a '+'
+    sign in front of the number, whereas that's not valid according to the RTF
+    spec; and it needs a nul-terminated copy of the number */
     if(ctx->pos[0] == '-' && g_ascii_isdigit(ctx->pos[1]))
-        length += 2;
-    while(g_ascii_isdigit(ctx->pos[length]))
-        length++;
-
-    if(length == 0)
-    return FALSE;
+    {
+        negative = TRUE;
+        ctx->pos++;
+    }
+    if(!g_ascii_isdigit(*ctx->pos))
+        return FALSE;
 
-    /* Convert it */
-    intstr = g_strndup(ctx->pos, length);
+    /* Convert it, clamping out-of-range values to the limits of gint32 */
+    while(g_ascii_isdigit(*ctx->pos))
+    {
+        if(magnitude <= G_MAXINT32)
+            magnitude = magnitude * 10 + (*ctx->pos - '0');
+        ctx->pos++;
+    }
     if(value)
-        *value = strtol(intstr, NULL, 10);
-    ctx->pos += length;
+    {
+        if(negative)
+            *value = (gint32)MAX(-magnitude, (gint64)G_MININT32);
+        else
+            *value = (gint32)MIN(magnitude, (gint64)G_MAXINT32);
+    }
 
     /* If the value is delimited by a space, discard the space */
     if(*(ctx->pos) == ' ')
@@ -372,6 +823,37 @@ parse_int_parameter(ParserContext *ctx, gint32 *value)
     return TRUE;
 }
 
+/* Parses the parameter of a \binN control word at 'pos', which points just
+after the control word, and returns the position of the binary data that
+follows it. The number of bytes of binary data is stored in 'length'; a
+negative parameter means no data, and the data never extends past the end of
+the input. */
+static const gchar *
+parse_binary_length(ParserContext *ctx, const gchar *pos, gsize *length)
+{
+    gboolean negative = FALSE;
+    gint64 value = 0;
+
+    if(*pos == '-')
+    {
+        negative = TRUE;
+        pos++;
+    }
+    while(g_ascii_isdigit(*pos))
+    {
+        if(value <= G_MAXINT32)
+            value = value * 10 + (*pos - '0');
+        pos++;
+    }
+    if(*pos == ' ')
+        pos++;
+
+    *length = negative? 0 : (gsize)MIN(value, ctx->end - pos);
+    return pos;
+}
+
+#define IS_BIN_CONTROL_WORD(word, length) ((length) == 3 && strncmp((word), "bin", 3) == 0)
+
 /* Skip one character or control word according to the RTF spec's convoluted
 skipping rules */
 gboolean
@@ -397,12 +879,22 @@ skip_character_or_control_word(ParserContext *ctx, GError **error)
             }
             else
             {
-                gchar *word = NULL;
-                gboolean success = parse_control_word(ctx, &word, error);
+                const gchar *word;
+                gsize length;
+                gboolean ignorable;
+
+                if(!parse_control_word(ctx, &word, &length, &ignorable, error))
+                    return FALSE;
+                /* \binN and its binary data count as one character */
+                if(IS_BIN_CONTROL_WORD(word, length))
+                {
+                    ctx->pos = parse_binary_length(ctx, ctx->pos, &length);
+                    ctx->pos += length;
+                    return TRUE;
+                }
                 if(!parse_int_parameter(ctx, NULL) && *(ctx->pos) == ' ')
                     ctx->pos++;
-                g_free(word);
-                return success;
+                return TRUE;
             }
         }
 
@@ -417,21 +909,137 @@ skip_character_or_control_word(ParserContext *ctx, GError **error)
     } while(TRUE);
 }
 
-/* Carry out the action associated with the control word 'text', as specified
-in the current destination's control word table */
+/* Skip the rest of the current group, which is a destination that is ignored,
+by scanning for the matching closing brace without parsing anything in between.
+Escaped braces and backslashes, \'xx codes, and the binary data after \binN are
+taken into account. The position is left at the closing brace, so that the main
+parser loop closes the group as usual. */
+gboolean
+skip_destination(ParserContext *ctx, GError **error)
+{
+    const gchar *pos = ctx->pos;
+    gint depth = 0;
+
+    /* Any text before the destination in this group is ignored as well */
+    g_string_truncate(ctx->text, 0);
+
+    while(TRUE)
+    {
+        pos += strcspn(pos, "{}\\");
+        switch(*pos)
+        {
+            case '{':
+                depth++;
+                pos++;
+                break;
+
+            case '}':
+                if(depth == 0)
+                {
+                    ctx->pos = pos;
+                    return TRUE;
+                }
+                depth--;
+                pos++;
+                break;
+
+            case '\\':
+                if(strncmp(pos + 1, "bin", 3) == 0 && !g_ascii_isalpha(pos[4]))
+                {
+                    /* Skip the binary data, which may contain anything */
+                    gsize length;
+
+                    pos = parse_binary_length(ctx, pos + 4, &length);
+                    pos += length;
+                }
+                /* Skip the character after the backslash, which may be an
+                escaped brace or backslash, or the quote of \'xx */
+                else if(pos[1] != '\0')
+                    pos += 2;
+                else
+                    pos++;
+                break;
+
+            default:
+                g_set_error(error, RTF_ERROR, RTF_ERROR_MISSING_BRACE, _("File ended unexpectedly"));
+                return FALSE;
+        }
+    }
+}
+
+/* Pass the binary data following a \binN control word to the current
+destination, if it accepts binary data, straight from the input buffer; and
+skip over it in any case */
+static void
+do_binary_data(ParserContext *ctx)
+{
+    Destination *dest = get_destination(ctx, 0);
+    gsize length;
+
+    ctx->pos = parse_binary_length(ctx, ctx->pos, &length);
+    if(dest->info->binary_data && length > 0)
+    {
+        /* Any text before the binary data comes first */
+        dest->info->flush(ctx);
+        dest->info->binary_data(ctx, (const guchar *)ctx->pos, length);
+    }
+    ctx->pos += length;
+}
+
+/* Call the action of the control word 'word', with the parameter 'param' if it
+is not NULL. Only an action that changes the state gets a copy of a state that
+the current group shares with enclosing groups; an action that only reads it
+gets it as it is, and must leave the state stack alone. */
+static gboolean
+call_word_action(ParserContext *ctx, const ControlWord *word, const gint32 *param, GError **error)
+{
+    guint depth = ctx->n_destinations - 1;
+    Destination *dest = get_destination(ctx, 0);
+    guint n_states = dest->n_states;
+    guint shares = (dest->info->state_size != 0 && n_states > 0)? dest->state_shares[n_states - 1] : 0;
+    gpointer state;
+    gboolean retval;
+
+    if(word->flags & PEEK_STATE)
+        state = (gpointer)peek_state(ctx);
+    else
+        state = get_state(ctx);
+
+    if(param)
+        retval = word->action(ctx, state, *param, error);
+    else
+        retval = word->action(ctx, state, error);
+
+    if(word->flags & PEEK_STATE)
+    {
+        /* The action may have pushed a destination, moving the stack */
+        dest = ctx->destinations + depth;
+        g_assert(dest->n_states == n_states);
+        g_assert(dest->info->state_size == 0 || dest->state_shares[n_states - 1] == shares);
+    }
+    return retval;
+}
+
+/* Carry out the action associated with the control word 'text' of length
+'length', as specified in the current destination's control word table */
 static gboolean
-do_word_action(ParserContext *ctx, const gchar *text, GError **error)
+do_word_action(ParserContext *ctx, const gchar *text, gsize length, gboolean ignorable, GError **error)
 {
     Destination *dest;
     const ControlWord *word;
 
-    dest = (Destination *)g_queue_peek_head(ctx->destination_stack);
+    /* \binN doesn't follow the regular syntax either, since its parameter is
+    followed by raw bytes */
+    if(IS_BIN_CONTROL_WORD(text, length))
+    {
+        do_binary_data(ctx);
+        return TRUE;
+    }
 
-    for(word = dest->info->word_table; word->word != NULL; word++)
-        if(strcmp(text, word->word) == 0)
-            break;
+    dest = get_destination(ctx, 0);
+    word = lookup_control_word(dest->word_index, ignorable, text, length);
 
-    if(word->word != NULL)
+    if(word != NULL)
     {
         gint32 param;
         switch(word->type)
@@ -440,9 +1048,9 @@ do_word_action(ParserContext *ctx, const gchar *text, GError **error)
                 if(*ctx->pos == ' ') /* Eat a space */
                     ctx->pos++;
                 g_assert(word->action);
-                if(word->flush_buffer)
+                if(word->flags & FLUSH_BUFFER)
                     dest->info->flush(ctx);
-                return word->action(ctx, get_state(ctx), error);
+                return call_word_action(ctx, word, NULL, error);
 
             case OPTIONAL_PARAMETER:
                 /* If the parameter is optional, carry out the action with the
@@ -451,27 +1059,27 @@ do_word_action(ParserContext *ctx, const gchar *text, GError **error)
                 g_assert(word->action);
                 if(parse_int_parameter(ctx, &param))
                 {
-                    if(word->flush_buffer)
+                    if(word->flags & FLUSH_BUFFER)
                         dest->info->flush(ctx);
-                    return word->action(ctx, get_state(ctx), param, error);
+                    return call_word_action(ctx, word, &param, error);
                 }
                 /* If no parameter, then eat a space */
                 if(*ctx->pos == ' ')
                     ctx->pos++;
-                if(word->flush_buffer)
+                if(word->flags & FLUSH_BUFFER)
                     dest->info->flush(ctx);
-                return word->action(ctx, get_state(ctx), word->defaultparam, error);
+                return call_word_action(ctx, word, &word->defaultparam, error);
 
             case REQUIRED_PARAMETER:
                 g_assert(word->action);
                 if(!parse_int_parameter(ctx, &param))
                 {
-                    g_set_error(error, RTF_ERROR, RTF_ERROR_MISSING_PARAMETER, _("Expected a number after control word '\\%s'"), text);
+                    g_set_error(error, RTF_ERROR, RTF_ERROR_MISSING_PARAMETER, _("Expected a number after control word '\\%s'"), word->word);
                     return FALSE;
                 }
-                if(word->flush_buffer)
+                if(word->flags & FLUSH_BUFFER)
                     dest->info->flush(ctx);
-                return word->action(ctx, get_state(ctx), param, error);
+                return call_word_action(ctx, word, &param, error);
 
             case SPECIAL_CHARACTER:
                 /* If the control word represents a special character, then just
@@ -485,7 +1093,12 @@ do_word_action(ParserContext *ctx, const gchar *text, GError **error)
             case DESTINATION:
                 if(*ctx->pos == ' ') /* Eat a space */
                     ctx->pos++;
-                if(word->action && !word->action(ctx, get_state(ctx), error))
+                if(word->destinfo == &ignore_destination)
+                    return skip_destination(ctx, error);
+                /* The new destination may put things into the buffer itself,
+                so insert the document text that came before it */
+                document_insert_runs(ctx);
+                if(word->action && !call_word_action(ctx, word, NULL, error))
                     return FALSE;
                 push_new_destination(ctx, word->destinfo, NULL);
                 return TRUE;
@@ -499,13 +1112,42 @@ do_word_action(ParserContext *ctx, const gchar *text, GError **error)
     if(!parse_int_parameter(ctx, NULL) && *ctx->pos == ' ')
         ctx->pos++;
     /* If the control word was an ignorable destination, and was not recognized,
-    push a new "ignore" destination onto the stack */
-    if(text[0] == '*')
-        push_new_destination(ctx, &ignore_destination, NULL);
+    skip the destination */
+    if(ignorable)
+        return skip_destination(ctx, error);
 
     return TRUE;
 }
 
+/* Returns the tag of kind 'kind' with value 'value' if it was cached by
+cache_tag(), or NULL otherwise */
+GtkTextTag *
+get_cached_tag(ParserContext *ctx, TagKind kind, gint value)
+{
+    if(ctx->tag_cache[kind] == NULL)
+        return NULL;
+    return g_hash_table_lookup(ctx->tag_cache[kind], GINT_TO_POINTER(value));
+}
+
+/* Remember 'tag' as the tag of kind 'kind' with value 'value' for the rest of
+the parse, so that it doesn't have to be looked up by name again */
+void
+cache_tag(ParserContext *ctx, TagKind kind, gint value, GtkTextTag *tag)
+{
+    if(ctx->tag_cache[kind] == NULL)
+        ctx->tag_cache[kind] = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_object_unref);
+    g_hash_table_replace(ctx->tag_cache[kind], GINT_TO_POINTER(value), g_object_ref(tag));
+}
+
+/* Forget the cached tag of kind 'kind' with value 'value'; call this when the
+tag is replaced in the tag table */
+void
+uncache_tag(ParserContext *ctx, TagKind kind, gint value)
+{
+    if(ctx->tag_cache[kind])
+        g_hash_table_remove(ctx->tag_cache[kind], GINT_TO_POINTER(value));
+}
+
 /* When exiting a group in the RTF code ('}'), this function is called to pop
 one element from the state stack, hence restoring the state before entering the
 current group. */
@@ -518,29 +1160,29 @@ pop_state(ParserContext *ctx)
 
     ctx->group_nesting_level--;
 
-    dest = (Destination *)g_queue_peek_head(ctx->destination_stack);
+    dest = get_destination(ctx, 0);
     dest->info->flush(ctx);
 
     if(ctx->group_nesting_level < dest->nesting_level)
     {
         if(dest->info->cleanup)
             dest->info->cleanup(ctx);
-        dest->info->state_free(g_queue_pop_head(dest->state_stack));
-        destination_free(g_queue_pop_head(ctx->destination_stack));
+        pop_destination(ctx);
 
         /* Also pop the state of the destination that called this one, since
          the opening brace was before the destination control word */
-        dest = (Destination *)g_queue_peek_head(ctx->destination_stack);
+        dest = get_destination(ctx, 0);
         dest->info->flush(ctx);
-        dest->info->state_free(g_queue_pop_head(dest->state_stack));
+        destination_pop_state(dest);
     }
     else
-        dest->info->state_free(g_queue_pop_head(dest->state_stack));
+        destination_pop_state(dest);
 }
 
-/* When entering a group in the RTF code ('{'), this function copies the current
-state and pushes it onto the state stack, so modifications of the state within
-the group do not affect the state outside of the group. */
+/* When entering a group in the RTF code ('{'), this function pushes the current
+state onto the state stack, so modifications of the state within the group do
+not affect the state outside of the group. The state is only copied once the
+group modifies it. */
 static void
 push_state(ParserContext *ctx)
 {
@@ -548,10 +1190,10 @@ push_state(ParserContext *ctx)
 
     g_assert(ctx != NULL);
 
-    dest = (Destination *)g_queue_peek_head(ctx->destination_stack);
+    dest = get_destination(ctx, 0);
     dest->info->flush(ctx);
     ctx->group_nesting_level++;
-    g_queue_push_head(dest->state_stack, dest->info->state_copy(g_queue_peek_head(dest->state_stack)));
+    destination_push_state(dest);
 }
 
 /* The main parser loop */
@@ -567,11 +1209,13 @@ parse_rtf(ParserContext *ctx, GError **error)
         }
         if(*ctx->pos == '{')
         {
+            convert_pending_bytes(ctx);
             ctx->pos++;
             push_state(ctx);
         }
         else if(*ctx->pos == '}')
         {
+            convert_pending_bytes(ctx);
             ctx->pos++;
             pop_state(ctx);
         }
@@ -580,16 +1224,14 @@ parse_rtf(ParserContext *ctx, GError **error)
             /* Special case: \' doesn't follow the regular syntax */
             if(ctx->pos[1] == '\'')
             {
-                gchar *hexcode, ch;
+                gchar ch;
 
                 if(!(isxdigit(ctx->pos[2]) && isxdigit(ctx->pos[3])))
                 {
                     g_set_error(error, RTF_ERROR, RTF_ERROR_BAD_HEX_CODE, _("Expected a two-character hexadecimal code after \\'"));
                     return FALSE;
                 }
-                hexcode = g_strndup(ctx->pos + 2, 2);
-                ch = strtol(hexcode, NULL, 16);
-                g_free(hexcode);
+                ch = (gchar)(g_ascii_xdigit_value(ctx->pos[2]) << 4 | g_ascii_xdigit_value(ctx->pos[3]));
                 ctx->pos += 4;
 
                 if(!convert_hex_to_utf8(ctx, ch, error))
@@ -597,10 +1239,13 @@ parse_rtf(ParserContext *ctx, GError **error)
             }
             else
             {
-                gchar *word = NULL;
-                gboolean success = parse_control_word(ctx, &word, error) && do_word_action(ctx, word, error);
-                g_free(word);
-                if(!success)
+                const gchar *word;
+                gsize length;
+                gboolean ignorable;
+
+                convert_pending_bytes(ctx);
+                if(!parse_control_word(ctx, &word, &length, &ignorable, error)
+                    || !do_word_action(ctx, word, length, ignorable, error))
                     return FALSE;
             }
         }
@@ -612,18 +1257,38 @@ parse_rtf(ParserContext *ctx, GError **error)
             ctx->pos++;
         else
         {
-            /* If there is any partial wide character in the convert buffer, then
-             try to combine it with this one as a double-byte character */
+            /* If there are bytes waiting in the convert buffer, then convert
+            them; if that leaves a partial wide character, then this character
+            is the rest of it */
+            convert_pending_bytes(ctx);
             if(ctx->convertbuffer->len)
             {
-                if(!convert_hex_to_utf8(ctx, *ctx->pos, error))
-                    return FALSE;
+                g_string_append_c(ctx->convertbuffer, *ctx->pos);
+                ctx->pos++;
             }
             else
-                /* Add character to current string */
-                g_string_append_c(ctx->text, *ctx->pos);
-
-            ctx->pos++;
+            {
+                /* Add this character and the rest of the run of plain text
+                to current string; or if the destination wants it, give it the
+                RTF code straight up to the next group or control word,
+                newlines included, after any text that was waiting already */
+                Destination *dest = get_destination(ctx, 0);
+                const gchar *run_end;
+
+                if(dest->info->plain_text)
+                {
+                    run_end = find_end_of_plain_text(ctx->pos + 1, ctx->end, TRUE);
+                    if(ctx->text->len)
+                        dest->info->flush(ctx);
+                    dest->info->plain_text(ctx, ctx->pos, run_end - ctx->pos);
+                }
+                else
+                {
+                    run_end = find_end_of_plain_text(ctx->pos + 1, ctx->end, FALSE);
+                    g_string_append_len(ctx->text, ctx->pos, run_end - ctx->pos);
+                }
+                ctx->pos = run_end;
+            }
         }
 
     } while(ctx->group_nesting_level > 0);
@@ -640,7 +1305,8 @@ parse_rtf(ParserContext *ctx, GError **error)
     return TRUE;
 }
 
-/* This function is called by gtk_text_buffer_deserialize() */
+/* This function is called by gtk_text_buffer_deserialize(); 'user_data' is the
+RtfImportOptions the format was registered with, or NULL */
 gboolean
 rtf_deserialize(GtkTextBuffer *register_buffer, GtkTextBuffer *content_buffer, GtkTextIter *iter, const gchar *data, gsize length, gboolean create_tags, gpointer user_data, GError **error)
 {
@@ -653,8 +1319,10 @@ rtf_deserialize(GtkTextBuffer *register_buffer, GtkTextBuffer *content_buffer, G
         return FALSE;
     }
 
-    ctx = parser_context_new(data, content_buffer, iter);
+    ctx = parser_context_new(data, length, content_buffer, iter, user_data);
     success = parse_rtf(ctx, error);
+    document_insert_runs(ctx);
+    insert_pictures(ctx);
     parser_context_free(ctx);
 
     return success;
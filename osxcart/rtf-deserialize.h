@@ -18,18 +18,71 @@ with Osxcart.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <glib.h>
 #include <gtk/gtk.h>
+#include <osxcart/rtf.h>
 #include "rtf-state.h"
 
 typedef struct _ParserContext ParserContext;
 typedef struct _ControlWord ControlWord;
+typedef struct _ControlWordIndex ControlWordIndex;
+typedef struct _Converter Converter;
 typedef struct _Destination Destination;
 typedef struct _DestinationInfo DestinationInfo;
 
+/* Kinds of tags applied to document text; together with a value, such as a
+color index or a font size in thousandths of a point, they identify a tag in
+the parser context's tag cache */
+typedef enum {
+    TAG_STYLE,
+    TAG_FOREGROUND,
+    TAG_BACKGROUND,
+    TAG_HIGHLIGHT,
+    TAG_FONT_SIZE,
+    TAG_SPACE_BEFORE,
+    TAG_SPACE_AFTER,
+    TAG_LEFT_MARGIN,
+    TAG_RIGHT_MARGIN,
+    TAG_INDENT,
+    TAG_INVISIBLE,
+    TAG_LANGUAGE,
+    TAG_UP,
+    TAG_DOWN,
+    TAG_LEADING,
+    TAG_SCALE,
+    TAG_ITALIC,
+    TAG_BOLD,
+    TAG_SMALLCAPS,
+    TAG_STRIKETHROUGH,
+    TAG_UNDERLINE_SINGLE,
+    TAG_UNDERLINE_DOUBLE,
+    TAG_UNDERLINE_WAVE,
+    TAG_LEFT,
+    TAG_RIGHT,
+    TAG_CENTER,
+    TAG_JUSTIFIED,
+    TAG_RIGHT_TO_LEFT,
+    TAG_LEFT_TO_RIGHT,
+    TAG_SUBSCRIPT,
+    TAG_SUPERSCRIPT,
+    TAG_FONT,
+    N_TAG_KINDS
+} TagKind;
+
+/* The public RtfImportOptions structure is opaque */
+struct _RtfImportOptions {
+    gboolean merge_tags;
+    gboolean lazy_pictures;
+    guint64 max_picture_pixels; /* 0 for no limit */
+    guint64 max_document_pixels; /* 0 for no limit */
+};
+
 #define POINTS_TO_PANGO(pts) ((gint)(pts * PANGO_SCALE))
+#define POINTS_TO_MILLIPOINTS(pts) ((gint)(pts * 1000.0 + 0.5))
 #define HALF_POINTS_TO_PANGO(halfpts) (halfpts * PANGO_SCALE / 2)
 #define TWIPS_TO_PANGO(twips) (twips * PANGO_SCALE / 20)
 
 struct _ParserContext {
+    RtfImportOptions options;
+
     /* Header information */
     gint codepage;
     gint default_codepage;
@@ -38,11 +91,13 @@ struct _ParserContext {
 
     /* Destination stack management */
     gint group_nesting_level;
-    GQueue *destination_stack;
+    Destination *destinations; /* The current destination is the last one */
+    guint n_destinations;
+    guint destinations_allocated;
 
     /* Tables */
-    GSList *color_table;
-    GSList *font_table;
+    GPtrArray *color_table; /* Color strings, indexed by color number */
+    GHashTable *font_table; /* Font number -> FontProperties */
 
     /* Other document attributes */
     gint footnote_number;
@@ -50,25 +105,48 @@ struct _ParserContext {
     /* Text information */
     const gchar *rtftext;
     const gchar *pos;
+    const gchar *end;
     GString *convertbuffer;
+    Converter *converter; /* Character set of the bytes in convertbuffer */
+    GHashTable *converters;
     /* Text waiting for insertion */
     GString *text;
+    /* Document text waiting for insertion, split into runs of text with the
+    same attributes */
+    GString *runs_text;
+    GArray *runs;
 
     /* Output references */
     GtkTextBuffer *textbuffer;
     GtkTextTagTable *tags;
+    GHashTable *tag_cache[N_TAG_KINDS]; /* Value -> GtkTextTag, for each kind */
+    GHashTable *tab_tags; /* TabStops -> GtkTextTag, by tab positions */
+    GHashTable *merged_tags; /* Attributes -> GtkTextTag or NULL, if merging tags;
+                              the tags are owned by the tag table */
+    GHashTable *merged_tag_keys; /* Description of properties -> merged
+                                  GtkTextTag in the tag table, if merging tags */
+    GHashTable *style_attributes; /* Style number -> Attributes of the style, if
+                                   merging tags instead of making style tags */
     GtkTextMark *startmark;
     GtkTextMark *endmark;
+    /* Pictures waiting for insertion, and the threads decoding them */
+    GPtrArray *pictures;
+    GThreadPool *picture_pool;
+    guint64 picture_pixels_left; /* If the document has a maximum */
 };
 
 struct _DestinationInfo {
     const ControlWord *word_table;
+    gsize *word_index; /* Holds the index of word_table once it is built */
     void (*flush)(ParserContext *);
+    gsize state_size;
     StateNewFunc *state_new;
     StateCopyFunc *state_copy;
     StateFreeFunc *state_free;
     void (*cleanup)(ParserContext *);
     gint (*get_codepage)(ParserContext *);
+    void (*binary_data)(ParserContext *, const guchar *, gsize);
+    void (*plain_text)(ParserContext *, const gchar *, gsize);
 };
 
 typedef enum {
@@ -79,10 +157,16 @@ typedef enum {
     DESTINATION
 } ControlWordType;
 
+typedef enum {
+    FLUSH_BUFFER = 1 << 0, /* Flush the pending text before the action */
+    PEEK_STATE = 1 << 1 /* The action only reads the state, so it doesn't need
+                           a copy of a state that is shared with other groups */
+} ControlWordFlags;
+
 struct _ControlWord {
     const gchar *word;
     ControlWordType type;
-    gboolean flush_buffer;
+    ControlWordFlags flags;
     gboolean (*action)();
     gint32 defaultparam;
     const gchar *replacetext;
@@ -91,21 +175,50 @@ struct _ControlWord {
 
 struct _Destination {
     gint nesting_level;
-    GQueue *state_stack;
     const DestinationInfo *info;
+    const ControlWordIndex *word_index;
+    /* State stack, stored contiguously; the topmost state is the last one.
+    Groups share the state of the enclosing group until they change it, so
+    each state also counts how many groups above it are sharing it. */
+    gchar *states;
+    guint *state_shares;
+    guint n_states;
+    gsize states_allocated; /* In bytes */
+    guint state_shares_allocated;
 };
 
 typedef struct {
     gint index;
     gint codepage;
     gchar *font_name;
+    gchar *family; /* Font family list for the font's tag, or NULL */
 } FontProperties;
 
-G_GNUC_INTERNAL void push_new_destination(ParserContext *ctx, const DestinationInfo *destinfo, gpointer state_to_copy);
+/* A run of document text waiting for insertion, all with the same attributes;
+it starts where the previous run ends */
+typedef struct {
+    gsize end; /* Byte offset into the parser context's runs_text */
+    Attributes attr;
+} TextRun;
+
+G_GNUC_INTERNAL void push_new_destination(ParserContext *ctx, const DestinationInfo *destinfo, gconstpointer state_to_copy);
+G_GNUC_INTERNAL Destination *get_destination(ParserContext *ctx, guint depth);
+G_GNUC_INTERNAL gpointer get_destination_state(Destination *dest);
+G_GNUC_INTERNAL gconstpointer peek_destination_state(Destination *dest);
+G_GNUC_INTERNAL gpointer get_destination_initial_state(Destination *dest);
 G_GNUC_INTERNAL gpointer get_state(ParserContext *ctx);
+G_GNUC_INTERNAL gconstpointer peek_state(ParserContext *ctx);
 G_GNUC_INTERNAL FontProperties *get_font_properties(ParserContext *ctx, int index);
+G_GNUC_INTERNAL const gchar *get_color(ParserContext *ctx, int index);
+G_GNUC_INTERNAL GtkTextTag *get_cached_tag(ParserContext *ctx, TagKind kind, gint value);
+G_GNUC_INTERNAL void cache_tag(ParserContext *ctx, TagKind kind, gint value, GtkTextTag *tag);
+G_GNUC_INTERNAL void uncache_tag(ParserContext *ctx, TagKind kind, gint value);
 G_GNUC_INTERNAL void flush_text(ParserContext *ctx);
 G_GNUC_INTERNAL gboolean skip_character_or_control_word(ParserContext *ctx, GError **error);
+G_GNUC_INTERNAL gboolean skip_destination(ParserContext *ctx, GError **error);
+G_GNUC_INTERNAL void insert_pictures(ParserContext *ctx);
+G_GNUC_INTERNAL GdkPixbuf *load_lazy_picture(GtkTextChildAnchor *anchor);
+G_GNUC_INTERNAL void materialize_pictures(GtkTextBuffer *buffer, const GtkTextIter *start, const GtkTextIter *end);
 G_GNUC_INTERNAL gboolean rtf_deserialize(GtkTextBuffer *register_buffer, GtkTextBuffer *content_buffer, GtkTextIter *iter, const gchar *data, gsize length, gboolean create_tags, gpointer user_data, GError **error);
 
 #endif /* __OSXCART_RTF_DESERIALIZE_H__ */
\ No newline at end of file
@@ -13,7 +13,6 @@ PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
 You should have received a copy of the GNU Lesser General Public License along
 with Osxcart.  If not, see <http://www.gnu.org/licenses/>. */
 
-#include <stdarg.h>
 #include <string.h>
 #include <glib.h>
 #include <config.h>
@@ -41,34 +40,38 @@ extern const DestinationInfo colortbl_destination, field_destination,
 
 const ControlWord document_word_table[] = {
     DOCUMENT_TEXT_CONTROL_WORDS,
-    { "ansi", NO_PARAMETER, FALSE, doc_ansi },
-    { "ansicpg", REQUIRED_PARAMETER, FALSE, doc_ansicpg },
-    { "cell", SPECIAL_CHARACTER, FALSE, NULL, 0, "\t" }, /* Fake tables */
-    { "colortbl", DESTINATION, FALSE, NULL, 0, NULL, &colortbl_destination },
-    { "deff", REQUIRED_PARAMETER, FALSE, doc_deff },
-    { "deflang", REQUIRED_PARAMETER, FALSE, doc_deflang },
-    { "field", DESTINATION, TRUE, NULL, 0, NULL, &field_destination },
-    { "fonttbl", DESTINATION, FALSE, NULL, 0, NULL, &fonttbl_destination },
-    { "footnote", DESTINATION, TRUE, doc_footnote, 0, NULL, &footnote_destination },
-    { "header", DESTINATION, FALSE, NULL, 0, NULL, &ignore_destination },
-    { "ilvl", REQUIRED_PARAMETER, FALSE, doc_ilvl },
-    { "info", DESTINATION, FALSE, NULL, 0, NULL, &ignore_destination },
-    { "mac", NO_PARAMETER, FALSE, doc_mac },
-    { "NeXTGraphic", DESTINATION, FALSE, NULL, 0, NULL, &nextgraphic_destination }, /* Apple extension */
-    { "pc", NO_PARAMETER, FALSE, doc_pc },
-    { "pca", NO_PARAMETER, FALSE, doc_pca },
-    { "pict", DESTINATION, FALSE, NULL, 0, NULL, &pict_destination },
-    { "row", SPECIAL_CHARACTER, FALSE, NULL, 0, "\n" }, /* Fake tables */
-    { "rtf", REQUIRED_PARAMETER, FALSE, doc_rtf },
-    { "stylesheet", DESTINATION, FALSE, NULL, 0, NULL, &stylesheet_destination },
+    { "ansi", NO_PARAMETER, PEEK_STATE, doc_ansi },
+    { "ansicpg", REQUIRED_PARAMETER, PEEK_STATE, doc_ansicpg },
+    { "cell", SPECIAL_CHARACTER, 0, NULL, 0, "\t" }, /* Fake tables */
+    { "colortbl", DESTINATION, 0, NULL, 0, NULL, &colortbl_destination },
+    { "deff", REQUIRED_PARAMETER, PEEK_STATE, doc_deff },
+    { "deflang", REQUIRED_PARAMETER, 0, doc_deflang },
+    { "field", DESTINATION, FLUSH_BUFFER, NULL, 0, NULL, &field_destination },
+    { "fonttbl", DESTINATION, 0, NULL, 0, NULL, &fonttbl_destination },
+    { "footnote", DESTINATION, FLUSH_BUFFER | PEEK_STATE, doc_footnote, 0, NULL, &footnote_destination },
+    { "header", DESTINATION, 0, NULL, 0, NULL, &ignore_destination },
+    { "ilvl", REQUIRED_PARAMETER, PEEK_STATE, doc_ilvl },
+    { "info", DESTINATION, 0, NULL, 0, NULL, &ignore_destination },
+    { "mac", NO_PARAMETER, PEEK_STATE, doc_mac },
+    { "NeXTGraphic", DESTINATION, 0, NULL, 0, NULL, &nextgraphic_destination }, /* Apple extension */
+    { "pc", NO_PARAMETER, PEEK_STATE, doc_pc },
+    { "pca", NO_PARAMETER, PEEK_STATE, doc_pca },
+    { "pict", DESTINATION, 0, NULL, 0, NULL, &pict_destination },
+    { "row", SPECIAL_CHARACTER, 0, NULL, 0, "\n" }, /* Fake tables */
+    { "rtf", REQUIRED_PARAMETER, PEEK_STATE, doc_rtf },
+    { "stylesheet", DESTINATION, 0, NULL, 0, NULL, &stylesheet_destination },
     { NULL }
 };
 
 DEFINE_ATTR_STATE_FUNCTIONS(Attributes, document)
 
+static gsize document_word_index = 0;
+
 const DestinationInfo document_destination = {
     document_word_table,
+    &document_word_index,
     document_text,
+    sizeof(Attributes),
     document_state_new,
     document_state_copy,
     document_state_free,
@@ -76,132 +79,620 @@ const DestinationInfo document_destination = {
     document_get_codepage
 };
 
-/* Space-saving function for apply_attributes() */
-static void
-apply_attribute(ParserContext *ctx, GtkTextIter *start, GtkTextIter *end, gchar *format, ...)
+/* Names of the tags of each kind; the value is formatted into the name */
+static const gchar *tag_name_formats[N_TAG_KINDS] = {
+    "osxcart-rtf-style-%i",
+    "osxcart-rtf-foreground-%i",
+    "osxcart-rtf-background-%i",
+    "osxcart-rtf-highlight-%i",
+    "osxcart-rtf-fontsize-%.3f", /* Special case, see format_tag_name() */
+    "osxcart-rtf-space-before-%i",
+    "osxcart-rtf-space-after-%i",
+    "osxcart-rtf-left-margin-%i",
+    "osxcart-rtf-right-margin-%i",
+    "osxcart-rtf-indent-%i",
+    "osxcart-rtf-invisible",
+    "osxcart-rtf-language-%i",
+    "osxcart-rtf-up-%i",
+    "osxcart-rtf-down-%i",
+    "osxcart-rtf-leading-%i",
+    "osxcart-rtf-scale-%i",
+    "osxcart-rtf-italic",
+    "osxcart-rtf-bold",
+    "osxcart-rtf-smallcaps",
+    "osxcart-rtf-strikethrough",
+    "osxcart-rtf-underline-single",
+    "osxcart-rtf-underline-double",
+    "osxcart-rtf-underline-wave",
+    "osxcart-rtf-left",
+    "osxcart-rtf-right",
+    "osxcart-rtf-center",
+    "osxcart-rtf-justified",
+    "osxcart-rtf-right-to-left",
+    "osxcart-rtf-left-to-right",
+    "osxcart-rtf-subscript",
+    "osxcart-rtf-superscript",
+    "osxcart-rtf-font-%i"
+};
+
+/* Returns a newly allocated string with the name of the tag of kind 'kind' with
+value 'value'. Font sizes are given in thousandths of a point. */
+static gchar *
+format_tag_name(TagKind kind, gint value)
 {
-    gchar *tagname;
-    va_list args;
+    if(kind == TAG_FONT_SIZE)
+        return g_strdup_printf(tag_name_formats[kind], value / 1000.0);
+    return g_strdup_printf(tag_name_formats[kind], value);
+}
+
+/* Returns the tag of kind 'kind' with value 'value', or NULL if it doesn't
+exist. The tag is looked up in the tag table the first time it is used in this
+parse, and after that it comes from the parser context's tag cache. */
+static GtkTextTag *
+lookup_tag(ParserContext *ctx, TagKind kind, gint value)
+{
+    GtkTextTag *tag = get_cached_tag(ctx, kind, value);
+
+    if(tag == NULL)
+    {
+        gchar *tagname = format_tag_name(kind, value);
+        tag = gtk_text_tag_table_lookup(ctx->tags, tagname);
+        g_free(tagname);
+        if(tag != NULL)
+            cache_tag(ctx, kind, value, tag);
+    }
+    return tag;
+}
+
+/* Creates the tag of kind 'kind' with value 'value', adds it to the tag table
+and the tag cache, and returns it. The tag must not exist yet. */
+static GtkTextTag *
+create_tag(ParserContext *ctx, TagKind kind, gint value)
+{
+    gchar *tagname = format_tag_name(kind, value);
+    GtkTextTag *tag = gtk_text_tag_new(tagname);
 
-    va_start(args, format);
-    tagname = g_strdup_vprintf(format, args);
-    va_end(args);
-    gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, tagname, start, end);
     g_free(tagname);
+    gtk_text_tag_table_add(ctx->tags, tag);
+    cache_tag(ctx, kind, value, tag);
+    g_object_unref(tag);
+    return tag;
 }
 
-/* Apply GtkTextTags to the range from start to end, depending on the current
-attributes 'attr'. */
-void
-apply_attributes(ParserContext *ctx, Attributes *attr, GtkTextIter *start, GtkTextIter *end)
+/* Returns whether a control word function should create the tag of kind 'kind'
+with value 'value': only if it doesn't exist yet, and the parser was not asked
+to merge tags, since merged tags are made straight from the attributes */
+static gboolean
+should_create_tag(ParserContext *ctx, TagKind kind, gint value)
+{
+    return !ctx->options.merge_tags && !lookup_tag(ctx, kind, value);
+}
+
+/* Returns whether style number 'style' was defined in the stylesheet */
+static gboolean
+style_is_defined(ParserContext *ctx, gint style)
+{
+    if(ctx->options.merge_tags)
+        return g_hash_table_lookup(ctx->style_attributes, GINT_TO_POINTER(style)) != NULL;
+    return lookup_tag(ctx, TAG_STYLE, style) != NULL;
+}
+
+/* Add the tag of kind 'kind' with value 'value' to the array 'tags' */
+static void
+add_tag(ParserContext *ctx, GPtrArray *tags, TagKind kind, gint value)
+{
+    GtkTextTag *tag = lookup_tag(ctx, kind, value);
+
+    if(tag == NULL)
+    {
+        gchar *tagname = format_tag_name(kind, value);
+        g_warning(_("Unknown tag '%s'"), tagname);
+        g_free(tagname);
+        return;
+    }
+    g_ptr_array_add(tags, tag);
+}
+
+/* Returns the tag for the tab stops 'tabs'. There is one tag for each distinct
+set of tab positions, named after the positions, and it is looked up in the tag
+table or created only the first time it is used in this parse. */
+static GtkTextTag *
+get_tab_stops_tag(ParserContext *ctx, TabStops *tabs)
+{
+    GtkTextTag *tag;
+    GString *tagname;
+    gint size, count;
+
+    if((tag = g_hash_table_lookup(ctx->tab_tags, tabs)) != NULL)
+        return tag;
+
+    tagname = g_string_new("osxcart-rtf-tabs");
+    size = pango_tab_array_get_size(tabs->array);
+    for(count = 0; count < size; count++)
+    {
+        gint location;
+        pango_tab_array_get_tab(tabs->array, count, NULL, &location);
+        g_string_append_printf(tagname, "-%i", location);
+    }
+    if((tag = gtk_text_tag_table_lookup(ctx->tags, tagname->str)) == NULL)
+    {
+        tag = gtk_text_tag_new(tagname->str);
+        g_object_set(tag,
+                     "tabs", tabs->array,
+                     "tabs-set", TRUE,
+                     NULL);
+        gtk_text_tag_table_add(ctx->tags, tag);
+        g_object_unref(tag);
+    }
+    g_string_free(tagname, TRUE);
+
+    g_hash_table_insert(ctx->tab_tags, tab_stops_ref(tabs), g_object_ref(tag));
+    return tag;
+}
+
+/* Add the separate GtkTextTags that text with attributes 'attr' should have,
+one for each attribute, to the array 'tags' */
+static void
+get_separate_tags(ParserContext *ctx, const Attributes *attr, GPtrArray *tags)
 {
     /* Tags with parameters */
     if(attr->style != -1)
-        apply_attribute(ctx, start, end, "osxcart-rtf-style-%i", attr->style);
+        add_tag(ctx, tags, TAG_STYLE, attr->style);
     if(attr->foreground != -1)
-        apply_attribute(ctx, start, end, "osxcart-rtf-foreground-%i", attr->foreground);
+        add_tag(ctx, tags, TAG_FOREGROUND, attr->foreground);
     if(attr->background != -1)
-        apply_attribute(ctx, start, end, "osxcart-rtf-background-%i", attr->background);
+        add_tag(ctx, tags, TAG_BACKGROUND, attr->background);
     if(attr->highlight != -1)
-        apply_attribute(ctx, start, end, "osxcart-rtf-highlight-%i", attr->highlight);
+        add_tag(ctx, tags, TAG_HIGHLIGHT, attr->highlight);
     if(attr->size != 0.0)
-        apply_attribute(ctx, start, end, "osxcart-rtf-fontsize-%.3f", attr->size);
+        add_tag(ctx, tags, TAG_FONT_SIZE, POINTS_TO_MILLIPOINTS(attr->size));
     if(attr->space_before != 0 && !attr->ignore_space_before)
-        apply_attribute(ctx, start, end, "osxcart-rtf-space-before-%i", attr->space_before);
+        add_tag(ctx, tags, TAG_SPACE_BEFORE, attr->space_before);
     if(attr->space_after != 0 && !attr->ignore_space_after)
-        apply_attribute(ctx, start, end, "osxcart-rtf-space-after-%i", attr->space_after);
+        add_tag(ctx, tags, TAG_SPACE_AFTER, attr->space_after);
     if(attr->left_margin != 0)
-        apply_attribute(ctx, start, end, "osxcart-rtf-left-margin-%i", attr->left_margin);
+        add_tag(ctx, tags, TAG_LEFT_MARGIN, attr->left_margin);
     if(attr->right_margin != 0)
-        apply_attribute(ctx, start, end, "osxcart-rtf-right-margin-%i", attr->right_margin);
+        add_tag(ctx, tags, TAG_RIGHT_MARGIN, attr->right_margin);
     if(attr->indent != 0)
-        apply_attribute(ctx, start, end, "osxcart-rtf-indent-%i", attr->indent);
+        add_tag(ctx, tags, TAG_INDENT, attr->indent);
     if(attr->invisible)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-invisible", start, end);
+        add_tag(ctx, tags, TAG_INVISIBLE, 0);
     if(attr->language != 1024)
-        apply_attribute(ctx, start, end, "osxcart-rtf-language-%i", attr->language);
+        add_tag(ctx, tags, TAG_LANGUAGE, attr->language);
     if(attr->rise != 0)
-        apply_attribute(ctx, start, end, "osxcart-rtf-%s-%i",
-            (attr->rise > 0)? "up" : "down",
+        add_tag(ctx, tags,
+            (attr->rise > 0)? TAG_UP : TAG_DOWN,
             ((attr->rise > 0)? 1 : -1) * attr->rise);
     if(attr->leading != 0)
-        apply_attribute(ctx, start, end, "osxcart-rtf-leading-%i", attr->leading);
+        add_tag(ctx, tags, TAG_LEADING, attr->leading);
     if(attr->scale != 100)
-        apply_attribute(ctx, start, end, "osxcart-rtf-scale-%i", attr->scale);
+        add_tag(ctx, tags, TAG_SCALE, attr->scale);
     /* Boolean tags */
     if(attr->italic)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-italic", start, end);
+        add_tag(ctx, tags, TAG_ITALIC, 0);
     if(attr->bold)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-bold", start, end);
+        add_tag(ctx, tags, TAG_BOLD, 0);
     if(attr->smallcaps)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-smallcaps", start, end);
+        add_tag(ctx, tags, TAG_SMALLCAPS, 0);
     if(attr->strikethrough)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-strikethrough", start, end);
+        add_tag(ctx, tags, TAG_STRIKETHROUGH, 0);
     if(attr->underline == PANGO_UNDERLINE_SINGLE)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-underline-single", start, end);
+        add_tag(ctx, tags, TAG_UNDERLINE_SINGLE, 0);
     if(attr->underline == PANGO_UNDERLINE_DOUBLE)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-underline-double", start, end);
+        add_tag(ctx, tags, TAG_UNDERLINE_DOUBLE, 0);
     if(attr->underline == PANGO_UNDERLINE_ERROR)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-underline-wave", start, end);
+        add_tag(ctx, tags, TAG_UNDERLINE_WAVE, 0);
     if(attr->justification == GTK_JUSTIFY_LEFT)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-left", start, end);
+        add_tag(ctx, tags, TAG_LEFT, 0);
     if(attr->justification == GTK_JUSTIFY_RIGHT)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-right", start, end);
+        add_tag(ctx, tags, TAG_RIGHT, 0);
     if(attr->justification == GTK_JUSTIFY_CENTER)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-center", start, end);
+        add_tag(ctx, tags, TAG_CENTER, 0);
     if(attr->justification == GTK_JUSTIFY_FILL)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-justified", start, end);
+        add_tag(ctx, tags, TAG_JUSTIFIED, 0);
     if(attr->pardirection == GTK_TEXT_DIR_RTL)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-right-to-left", start, end);
+        add_tag(ctx, tags, TAG_RIGHT_TO_LEFT, 0);
     if(attr->pardirection == GTK_TEXT_DIR_LTR)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-left-to-right", start, end);
+        add_tag(ctx, tags, TAG_LEFT_TO_RIGHT, 0);
     /* Character-formatting direction overrides paragraph formatting */
     if(attr->chardirection == GTK_TEXT_DIR_RTL)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-right-to-left", start, end);
+        add_tag(ctx, tags, TAG_RIGHT_TO_LEFT, 0);
     if(attr->chardirection == GTK_TEXT_DIR_LTR)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-left-to-right", start, end);
+        add_tag(ctx, tags, TAG_LEFT_TO_RIGHT, 0);
     if(attr->subscript)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-subscript", start, end);
+        add_tag(ctx, tags, TAG_SUBSCRIPT, 0);
     if(attr->superscript)
-        gtk_text_buffer_apply_tag_by_name(ctx->textbuffer, "osxcart-rtf-superscript", start, end);
+        add_tag(ctx, tags, TAG_SUPERSCRIPT, 0);
     /* Special */
     if(attr->font != -1)
-        apply_attribute(ctx, start, end, "osxcart-rtf-font-%i", attr->font);
-    else if(ctx->default_font != -1 && g_slist_length(ctx->font_table) > (unsigned)ctx->default_font)
-        apply_attribute(ctx, start, end, "osxcart-rtf-font-%i", ctx->default_font);
+        add_tag(ctx, tags, TAG_FONT, attr->font);
+    else if(ctx->default_font != -1 && get_font_properties(ctx, ctx->default_font) != NULL)
+        add_tag(ctx, tags, TAG_FONT, ctx->default_font);
+    if(attr->tabs != NULL)
+        g_ptr_array_add(tags, get_tab_stops_tag(ctx, attr->tabs));
+}
+
+/* Set the integer property 'name' of the merged tag 'tag', and the property's
+"-set" property, to 'value', and record the value in the description of the
+tag's properties, 'description' */
+static void
+set_merged_int(GtkTextTag *tag, GTree *description, const gchar *name, gint value)
+{
+    gchar *setname = g_strconcat(name, "-set", NULL);
+    g_object_set(tag, name, value, setname, TRUE, NULL);
+    g_free(setname);
+    g_tree_replace(description, (gpointer)name, g_strdup_printf("%i", value));
+}
+
+/* Same as set_merged_int() for a floating-point property */
+static void
+set_merged_double(GtkTextTag *tag, GTree *description, const gchar *name, gdouble value)
+{
+    gchar *setname = g_strconcat(name, "-set", NULL);
+    g_object_set(tag, name, value, setname, TRUE, NULL);
+    g_free(setname);
+    g_tree_replace(description, (gpointer)name, g_strdup_printf("%g", value));
+}
+
+/* Same as set_merged_int() for a string property */
+static void
+set_merged_string(GtkTextTag *tag, GTree *description, const gchar *name, const gchar *value)
+{
+    gchar *setname = g_strconcat(name, "-set", NULL);
+    g_object_set(tag, name, value, setname, TRUE, NULL);
+    g_free(setname);
+    g_tree_replace(description, (gpointer)name, g_strdup(value));
+}
+
+/* Set the font family of font number 'font' on the merged tag 'tag', the same
+way as the font's tag would have it */
+static void
+set_merged_font(ParserContext *ctx, GtkTextTag *tag, GTree *description, gint font)
+{
+    FontProperties *fontprop = get_font_properties(ctx, font);
+    if(fontprop != NULL && fontprop->family != NULL)
+        set_merged_string(tag, description, "family", fontprop->family);
+}
+
+/* Set the properties on the merged tag 'tag' that the separate tags for text
+with attributes 'attr' would have, with the same values that the control word
+functions below give the separate tags. The font family is not set here. */
+static void
+set_merged_tag_properties(ParserContext *ctx, GtkTextTag *tag, GTree *description, const Attributes *attr)
+{
+    /* Tags with parameters; the colors must exist, because that was already
+    checked when executing the control words */
+    if(attr->foreground != -1)
+        set_merged_string(tag, description, "foreground", get_color(ctx, attr->foreground));
+    if(attr->background != -1)
+        set_merged_string(tag, description, "background", get_color(ctx, attr->background));
+    if(attr->highlight != -1)
+        set_merged_string(tag, description, "paragraph-background", get_color(ctx, attr->highlight));
+    if(attr->size != 0.0)
+        set_merged_int(tag, description, "size", POINTS_TO_PANGO(attr->size));
+    if(attr->space_before != 0 && !attr->ignore_space_before)
+        set_merged_int(tag, description, "pixels-above-lines", PANGO_PIXELS(TWIPS_TO_PANGO(attr->space_before)));
+    if(attr->space_after != 0 && !attr->ignore_space_after)
+        set_merged_int(tag, description, "pixels-below-lines", PANGO_PIXELS(TWIPS_TO_PANGO(attr->space_after)));
+    if(attr->left_margin != 0)
+        set_merged_int(tag, description, "left-margin", PANGO_PIXELS(TWIPS_TO_PANGO(attr->left_margin)));
+    if(attr->right_margin != 0)
+        set_merged_int(tag, description, "right-margin", PANGO_PIXELS(TWIPS_TO_PANGO(attr->right_margin)));
+    if(attr->indent != 0)
+        set_merged_int(tag, description, "indent", PANGO_PIXELS(TWIPS_TO_PANGO(attr->indent)));
+    if(attr->invisible)
+        set_merged_int(tag, description, "invisible", TRUE);
+    if(attr->language != 1024)
+        set_merged_string(tag, description, "language", language_to_iso(attr->language));
+    if(attr->rise != 0)
+        set_merged_int(tag, description, "rise", HALF_POINTS_TO_PANGO(attr->rise));
+    if(attr->leading != 0)
+        set_merged_int(tag, description, "pixels-inside-wrap", PANGO_PIXELS(TWIPS_TO_PANGO(attr->leading)));
+    if(attr->scale != 100)
+        set_merged_double(tag, description, "scale", (double)attr->scale / 100.0);
+    /* Boolean tags */
+    if(attr->italic)
+        set_merged_int(tag, description, "style", PANGO_STYLE_ITALIC);
+    if(attr->bold)
+        set_merged_int(tag, description, "weight", PANGO_WEIGHT_BOLD);
+    if(attr->smallcaps)
+        set_merged_int(tag, description, "variant", PANGO_VARIANT_SMALL_CAPS);
+    if(attr->strikethrough)
+        set_merged_int(tag, description, "strikethrough", TRUE);
+    if(attr->underline == PANGO_UNDERLINE_SINGLE
+        || attr->underline == PANGO_UNDERLINE_DOUBLE
+        || attr->underline == PANGO_UNDERLINE_ERROR)
+        set_merged_int(tag, description, "underline", attr->underline);
+    if(attr->justification == GTK_JUSTIFY_LEFT
+        || attr->justification == GTK_JUSTIFY_RIGHT
+        || attr->justification == GTK_JUSTIFY_CENTER
+        || attr->justification == GTK_JUSTIFY_FILL)
+        set_merged_int(tag, description, "justification", attr->justification);
+    /* Character-formatting direction overrides paragraph formatting; the text
+    direction has no "-set" property */
+    if(attr->pardirection == GTK_TEXT_DIR_RTL || attr->pardirection == GTK_TEXT_DIR_LTR)
+    {
+        g_object_set(tag, "direction", attr->pardirection, NULL);
+        g_tree_replace(description, "direction", g_strdup_printf("%i", attr->pardirection));
+    }
+    if(attr->chardirection == GTK_TEXT_DIR_RTL || attr->chardirection == GTK_TEXT_DIR_LTR)
+    {
+        g_object_set(tag, "direction", attr->chardirection, NULL);
+        g_tree_replace(description, "direction", g_strdup_printf("%i", attr->chardirection));
+    }
+    /* Superscript and subscript look like any other raised or lowered text by
+    their properties, so they are marked on the tag with the RTF code that the
+    writer should use for them */
+    if(attr->subscript)
+    {
+        set_merged_int(tag, description, "rise", POINTS_TO_PANGO(-6));
+        set_merged_double(tag, description, "scale", PANGO_SCALE_X_SMALL);
+        g_object_set_data(G_OBJECT(tag), "osxcart-rtf-script", "\\sub");
+        g_tree_replace(description, "osxcart-rtf-script", g_strdup("\\sub"));
+    }
+    if(attr->superscript)
+    {
+        set_merged_int(tag, description, "rise", POINTS_TO_PANGO(6));
+        set_merged_double(tag, description, "scale", PANGO_SCALE_X_SMALL);
+        g_object_set_data(G_OBJECT(tag), "osxcart-rtf-script", "\\super");
+        g_tree_replace(description, "osxcart-rtf-script", g_strdup("\\super"));
+    }
     if(attr->tabs != NULL)
     {
-        /* Create a separate tag for each PangoTabArray */
-        gchar *tagname = g_strdup_printf("osxcart-rtf-tabs-%p", attr->tabs);
-        GtkTextTag *tag;
-        if((tag = gtk_text_tag_table_lookup(ctx->tags, tagname)) == NULL)
+        GString *positions = g_string_new("");
+        gint size = pango_tab_array_get_size(attr->tabs->array), count;
+
+        for(count = 0; count < size; count++)
         {
-            tag = gtk_text_tag_new(tagname);
-            g_object_set(tag,
-                         "tabs", attr->tabs,
-                         "tabs-set", TRUE,
-                         NULL);
-            gtk_text_tag_table_add(ctx->tags, tag);
+            gint location;
+            pango_tab_array_get_tab(attr->tabs->array, count, NULL, &location);
+            g_string_append_printf(positions, " %i", location);
         }
-        g_free(tagname);
-        gtk_text_buffer_apply_tag(ctx->textbuffer, tag, start, end);
+        g_object_set(tag,
+                     "tabs", attr->tabs->array,
+                     "tabs-set", TRUE,
+                     NULL);
+        g_tree_replace(description, "tabs", g_string_free(positions, FALSE));
     }
 }
 
-/* Inserts the pending text with the current attributes. This function is called
-whenever a group is opened or closed, or a control word specifies to flush the
-pending text. */
+/* Append one line "name=value" to the description 'key' of a merged tag's
+properties, for each property in the description tree */
+static gboolean
+append_merged_tag_key(const gchar *name, const gchar *value, GString *key)
+{
+    g_string_append_printf(key, "%s=%s\n", name, value);
+    return FALSE; /* Continue */
+}
+
+/* Called for each tag in the tag table at the start of a parse that merges
+tags, to remember the merged tags left by earlier imports so that they can be
+used again */
 void
-document_text(ParserContext *ctx)
+index_merged_tag(GtkTextTag *tag, GHashTable *merged_tag_keys)
+{
+    const gchar *key = g_object_get_data(G_OBJECT(tag), "osxcart-rtf-merged-tag");
+    if(key)
+        g_hash_table_insert(merged_tag_keys, (gpointer)key, tag);
+}
+
+/* Get the one merged tag for text with attributes 'attr', which has all the
+properties that the separate tags would have. The properties are taken straight
+from the attributes: first the font family, then the attributes of the text's
+style, and then the text's own attributes, each overriding the one before. Each
+distinct set of attributes gets a merged tag once per parse, after which it
+comes from the parser context's table of merged tags. The merged tags are
+anonymous, but remember a description of their properties, so that a merged tag
+that looks the same, from an earlier import, is used instead of adding another
+one to the tag table. Returns NULL if the text should not be tagged at all. */
+static GtkTextTag *
+get_merged_tag(ParserContext *ctx, const Attributes *attr)
+{
+    GtkTextTag *tag, *existing;
+    GTree *description;
+    const Attributes *style = NULL;
+    GString *key;
+
+    if(g_hash_table_lookup_extended(ctx->merged_tags, attr, NULL, (gpointer *)&tag))
+        return tag;
+
+    tag = gtk_text_tag_new(NULL);
+    description = g_tree_new_full((GCompareDataFunc)strcmp, NULL, NULL, g_free);
+
+    if(attr->font != -1)
+        set_merged_font(ctx, tag, description, attr->font);
+    else if(ctx->default_font != -1)
+        set_merged_font(ctx, tag, description, ctx->default_font);
+    if(attr->style != -1)
+        style = g_hash_table_lookup(ctx->style_attributes, GINT_TO_POINTER(attr->style));
+    if(style != NULL)
+    {
+        if(style->font != -1)
+            set_merged_font(ctx, tag, description, style->font);
+        set_merged_tag_properties(ctx, tag, description, style);
+    }
+    set_merged_tag_properties(ctx, tag, description, attr);
+
+    key = g_string_new("");
+    g_tree_foreach(description, (GTraverseFunc)append_merged_tag_key, key);
+    g_tree_destroy(description);
+
+    if(key->len == 0)
+    {
+        g_object_unref(tag);
+        tag = NULL;
+        g_string_free(key, TRUE);
+    }
+    else if((existing = g_hash_table_lookup(ctx->merged_tag_keys, key->str)) != NULL)
+    {
+        g_object_unref(tag);
+        tag = existing;
+        g_string_free(key, TRUE);
+    }
+    else
+    {
+        g_object_set_data_full(G_OBJECT(tag), "osxcart-rtf-merged-tag", g_string_free(key, FALSE), g_free);
+        gtk_text_tag_table_add(ctx->tags, tag);
+        g_object_unref(tag);
+        index_merged_tag(tag, ctx->merged_tag_keys);
+    }
+
+    g_hash_table_insert(ctx->merged_tags, attributes_copy(attr), tag);
+    return tag;
+}
+
+/* Add the GtkTextTags that text with attributes 'attr' should have to the
+array 'tags': either one tag for each attribute, or if the parser was asked to
+merge tags, one tag for all of them */
+static void
+get_attribute_tags(ParserContext *ctx, const Attributes *attr, GPtrArray *tags)
+{
+    if(ctx->options.merge_tags)
+    {
+        GtkTextTag *tag = get_merged_tag(ctx, attr);
+        if(tag != NULL)
+            g_ptr_array_add(tags, tag);
+        return;
+    }
+    get_separate_tags(ctx, attr, tags);
+}
+
+/* Apply GtkTextTags to the range from start to end, depending on the current
+attributes 'attr'. */
+void
+apply_attributes(ParserContext *ctx, const Attributes *attr, GtkTextIter *start, GtkTextIter *end)
+{
+    GPtrArray *tags = g_ptr_array_new();
+    guint count;
+
+    get_attribute_tags(ctx, attr, tags);
+    for(count = 0; count < tags->len; count++)
+        gtk_text_buffer_apply_tag(ctx->textbuffer, g_ptr_array_index(tags, count), start, end);
+    g_ptr_array_free(tags, TRUE);
+}
+
+/* Returns whether 'array' contains 'pointer' */
+static gboolean
+ptr_array_contains(GPtrArray *array, gpointer pointer)
+{
+    guint count;
+    for(count = 0; count < array->len; count++)
+        if(g_ptr_array_index(array, count) == pointer)
+            return TRUE;
+    return FALSE;
+}
+
+/* Apply 'tag' to the characters from 'start' to 'end', counted from 'offset' */
+static void
+apply_tag_at_offsets(ParserContext *ctx, GtkTextTag *tag, gint offset, gint start, gint end)
+{
+    GtkTextIter startiter, enditer;
+
+    if(start == end)
+        return;
+    gtk_text_buffer_get_iter_at_offset(ctx->textbuffer, &startiter, offset + start);
+    gtk_text_buffer_get_iter_at_offset(ctx->textbuffer, &enditer, offset + end);
+    gtk_text_buffer_apply_tag(ctx->textbuffer, tag, &startiter, &enditer);
+}
+
+/* Inserts the document text collected so far into the text buffer. The text is
+inserted in one go, and then the runs are tagged in order; each tag is applied
+once to the whole stretch of consecutive runs that have it, instead of once per
+run. This function must be called before anything else changes the text
+buffer. */
+void
+document_insert_runs(ParserContext *ctx)
 {
     GtkTextIter start, end;
-    Attributes *attr;
+    GPtrArray *runtags, *opentags;
+    GArray *openoffsets;
+    gint offset, chars, tagstart;
+    gsize runstart = 0;
+    guint count, tagcount;
+
+    g_assert(ctx != NULL);
+
+    if(ctx->runs->len == 0)
+        return;
+
+    /* Anything that was inserted between the two marks since the last time,
+    such as a picture, gets the attributes of the first run */
+    gtk_text_buffer_get_iter_at_mark(ctx->textbuffer, &start, ctx->startmark);
+    gtk_text_buffer_get_iter_at_mark(ctx->textbuffer, &end, ctx->endmark);
+    offset = gtk_text_iter_get_offset(&start);
+    chars = gtk_text_iter_get_offset(&end) - offset;
+    gtk_text_buffer_insert(ctx->textbuffer, &end, ctx->runs_text->str, ctx->runs_text->len);
+
+    /* Tags that the runs so far have, and the character offsets where they
+    started */
+    runtags = g_ptr_array_new();
+    opentags = g_ptr_array_new();
+    openoffsets = g_array_new(FALSE, FALSE, sizeof(gint));
+
+    for(count = 0; count < ctx->runs->len; count++)
+    {
+        TextRun *run = &g_array_index(ctx->runs, TextRun, count);
+
+        g_ptr_array_set_size(runtags, 0);
+        get_attribute_tags(ctx, &run->attr, runtags);
+
+        /* Apply the tags that this run doesn't have anymore */
+        for(tagcount = opentags->len; tagcount-- > 0; )
+        {
+            GtkTextTag *tag = g_ptr_array_index(opentags, tagcount);
+            if(ptr_array_contains(runtags, tag))
+                continue;
+            apply_tag_at_offsets(ctx, tag, offset, g_array_index(openoffsets, gint, tagcount), chars);
+            g_ptr_array_remove_index(opentags, tagcount);
+            g_array_remove_index(openoffsets, tagcount);
+        }
+        /* Start the tags that this run has and the previous one didn't; the
+        first run's tags start at the start mark */
+        tagstart = (count == 0)? 0 : chars;
+        for(tagcount = 0; tagcount < runtags->len; tagcount++)
+        {
+            GtkTextTag *tag = g_ptr_array_index(runtags, tagcount);
+            if(ptr_array_contains(opentags, tag))
+                continue;
+            g_ptr_array_add(opentags, tag);
+            g_array_append_val(openoffsets, tagstart);
+        }
+
+        chars += g_utf8_strlen(ctx->runs_text->str + runstart, run->end - runstart);
+        runstart = run->end;
+        if(run->attr.tabs)
+            tab_stops_unref(run->attr.tabs);
+    }
+    for(tagcount = 0; tagcount < opentags->len; tagcount++)
+        apply_tag_at_offsets(ctx, g_ptr_array_index(opentags, tagcount), offset, g_array_index(openoffsets, gint, tagcount), chars);
+
+    g_ptr_array_free(runtags, TRUE);
+    g_ptr_array_free(opentags, TRUE);
+    g_array_free(openoffsets, TRUE);
+
+    /* Move the two marks back together again */
+    gtk_text_buffer_get_iter_at_mark(ctx->textbuffer, &end, ctx->endmark);
+    gtk_text_buffer_move_mark(ctx->textbuffer, ctx->startmark, &end);
+
+    g_string_truncate(ctx->runs_text, 0);
+    g_array_set_size(ctx->runs, 0);
+}
+
+/* Adds the pending text with the current attributes to the document. This
+function is called whenever a group is opened or closed, or a control word
+specifies to flush the pending text. The text is not inserted into the text
+buffer yet; see document_insert_runs(). */
+void
+document_text(ParserContext *ctx)
+{
+    const Attributes *attr;
     int length;
     gchar *text;
 
     g_assert(ctx != NULL);
 
-    attr = get_state(ctx);
+    attr = peek_state(ctx);
     text = ctx->text->str;
 
     if(text[0] == '\0')
@@ -211,17 +702,23 @@ document_text(ParserContext *ctx)
     if(!ctx->group_nesting_level && text[length] == '\n')
         text[length] = '\0';
 
-    if(!attr->unicode_ignore)
+    if(!attr->unicode_ignore && text[0] != '\0')
     {
-        gtk_text_buffer_get_iter_at_mark(ctx->textbuffer, &end, ctx->endmark); /* shouldn't invalidate end, but it does? */
-        gtk_text_buffer_insert(ctx->textbuffer, &end, text, -1);
-        gtk_text_buffer_get_iter_at_mark(ctx->textbuffer, &start, ctx->startmark);
-        gtk_text_buffer_get_iter_at_mark(ctx->textbuffer, &end, ctx->endmark);
+        TextRun *run = NULL;
 
-        apply_attributes(ctx, attr, &start, &end);
-
-        /* Move the two marks back together again */
-        gtk_text_buffer_move_mark(ctx->textbuffer, ctx->startmark, &end);
+        /* Extend the last run if the attributes are the same */
+        if(ctx->runs->len > 0)
+            run = &g_array_index(ctx->runs, TextRun, ctx->runs->len - 1);
+        if(run == NULL || !attributes_equal(attr, &run->attr))
+        {
+            g_array_set_size(ctx->runs, ctx->runs->len + 1);
+            run = &g_array_index(ctx->runs, TextRun, ctx->runs->len - 1);
+            run->attr = *attr;
+            if(attr->tabs)
+                tab_stops_ref(attr->tabs);
+        }
+        g_string_append(ctx->runs_text, text);
+        run->end = ctx->runs_text->len;
     }
     g_string_truncate(ctx->text, 0);
 }
@@ -230,7 +727,7 @@ document_text(ParserContext *ctx)
 gint
 document_get_codepage(ParserContext *ctx)
 {
-    Attributes *attr = get_state(ctx);
+    const Attributes *attr = peek_state(ctx);
     if(attr->font != -1)
     {
         FontProperties *fontprop = get_font_properties(ctx, attr->font);
@@ -259,11 +756,10 @@ doc_ansicpg(ParserContext *ctx, Attributes *attr, gint32 codepage, GError **erro
 gboolean
 doc_b(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-bold"))
+    if(should_create_tag(ctx, TAG_BOLD, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-bold");
+        GtkTextTag *tag = create_tag(ctx, TAG_BOLD, 0);
         g_object_set(tag, "weight", PANGO_WEIGHT_BOLD, NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->bold = (param != 0);
     return TRUE;
@@ -272,25 +768,22 @@ doc_b(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 gboolean
 doc_cb(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    gchar *color;
+    const gchar *color;
 
-    if((color = g_slist_nth_data(ctx->color_table, param)) == NULL)
+    if((color = get_color(ctx, param)) == NULL)
     {
         g_set_error(error, RTF_ERROR, RTF_ERROR_UNDEFINED_COLOR, _("Color '%i' undefined"), param);
         return FALSE;
     }
 
-    gchar *tagname = g_strdup_printf("osxcart-rtf-background-%i", param);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_BACKGROUND, param))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_BACKGROUND, param);
         g_object_set(tag,
                      "background", color,
                      "background-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->background = param;
     return TRUE;
@@ -299,25 +792,22 @@ doc_cb(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 gboolean
 doc_cf(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    gchar *color;
+    const gchar *color;
 
-    if((color = g_slist_nth_data(ctx->color_table, param)) == NULL)
+    if((color = get_color(ctx, param)) == NULL)
     {
         g_set_error(error, RTF_ERROR, RTF_ERROR_UNDEFINED_COLOR, _("Color '%i' undefined"), param);
         return FALSE;
     }
 
-    gchar *tagname = g_strdup_printf("osxcart-rtf-foreground-%i", param);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_FOREGROUND, param))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_FOREGROUND, param);
         g_object_set(tag,
                      "foreground", color,
                      "foreground-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->foreground = param;
     return TRUE;
@@ -332,17 +822,14 @@ doc_charscalex(ParserContext *ctx, Attributes *attr, gint32 scale, GError **erro
         return FALSE;
     }
 
-    char *tagname = g_strdup_printf("osxcart-rtf-scale-%i", scale);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_SCALE, scale))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_SCALE, scale);
         g_object_set(tag,
                      "scale", (double)scale / 100.0,
                      "scale-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->scale = scale;
     return TRUE;
@@ -376,17 +863,14 @@ doc_dn(ParserContext *ctx, Attributes *attr, gint32 halfpoints, GError **error)
 {
     if(halfpoints != 0)
     {
-        gchar *tagname = g_strdup_printf("osxcart-rtf-down-%i", halfpoints);
-        if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+        if(should_create_tag(ctx, TAG_DOWN, halfpoints))
         {
-            GtkTextTag *tag = gtk_text_tag_new(tagname);
+            GtkTextTag *tag = create_tag(ctx, TAG_DOWN, halfpoints);
             g_object_set(tag,
                          "rise", HALF_POINTS_TO_PANGO(-halfpoints),
                          "rise-set", TRUE,
                          NULL);
-            gtk_text_tag_table_add(ctx->tags, tag);
         }
-        g_free(tagname);
     }
 
     attr->rise = -halfpoints;
@@ -409,17 +893,14 @@ doc_f(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 gboolean
 doc_fi(ParserContext *ctx, Attributes *attr, gint32 twips, GError **error)
 {
-    gchar *tagname = g_strdup_printf("osxcart-rtf-indent-%i", twips);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_INDENT, twips))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_INDENT, twips);
         g_object_set(tag,
                      "indent", PANGO_PIXELS(TWIPS_TO_PANGO(twips)),
                      "indent-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->indent = twips;
     return TRUE;
@@ -450,17 +931,14 @@ doc_fs(ParserContext *ctx, Attributes *attr, gint32 halfpoints, GError **error)
     }
 
     gdouble points = halfpoints / 2.0;
-    gchar *tagname = g_strdup_printf("osxcart-rtf-fontsize-%.3f", points);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_FONT_SIZE, POINTS_TO_MILLIPOINTS(points)))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_FONT_SIZE, POINTS_TO_MILLIPOINTS(points));
         g_object_set(tag,
                      "size", POINTS_TO_PANGO(points),
                      "size-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->size = points;
     return TRUE;
@@ -476,17 +954,14 @@ doc_fsmilli(ParserContext *ctx, Attributes *attr, gint32 milli, GError **error)
     }
 
     gdouble points = milli / 1000.0;
-    gchar *tagname = g_strdup_printf("osxcart-rtf-fontsize-%.3f", points);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_FONT_SIZE, POINTS_TO_MILLIPOINTS(points)))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_FONT_SIZE, POINTS_TO_MILLIPOINTS(points));
         g_object_set(tag,
                      "size", POINTS_TO_PANGO(points),
                      "size-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->size = points;
     return TRUE;
@@ -495,25 +970,22 @@ doc_fsmilli(ParserContext *ctx, Attributes *attr, gint32 milli, GError **error)
 gboolean
 doc_highlight(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    gchar *color;
+    const gchar *color;
 
-    if((color = g_slist_nth_data(ctx->color_table, param)) == NULL)
+    if((color = get_color(ctx, param)) == NULL)
     {
         g_set_error(error, RTF_ERROR, RTF_ERROR_UNDEFINED_COLOR, _("Color '%i' undefined"), param);
         return FALSE;
     }
 
-    gchar *tagname = g_strdup_printf("osxcart-rtf-highlight-%i", param);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_HIGHLIGHT, param))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_HIGHLIGHT, param);
         g_object_set(tag,
                      "paragraph-background", color,
                      "paragraph-background-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->background = param;
     return TRUE;
@@ -522,14 +994,13 @@ doc_highlight(ParserContext *ctx, Attributes *attr, gint32 param, GError **error
 gboolean
 doc_i(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-italic"))
+    if(should_create_tag(ctx, TAG_ITALIC, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-italic");
+        GtkTextTag *tag = create_tag(ctx, TAG_ITALIC, 0);
         g_object_set(tag,
                      "style", PANGO_STYLE_ITALIC,
                      "style-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->italic = (param != 0);
     return TRUE;
@@ -542,6 +1013,7 @@ doc_ilvl(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
     GtkTextIter iter;
     gchar *tabstring = g_strnfill(param, '\t');
 
+    document_insert_runs(ctx);
     gtk_text_buffer_get_end_iter(ctx->textbuffer, &iter);
     gtk_text_iter_set_line_offset(&iter, 0);
     gtk_text_buffer_insert(ctx->textbuffer, &iter, tabstring, -1);
@@ -557,17 +1029,14 @@ gboolean
 doc_lang(ParserContext *ctx, Attributes *attr, gint32 language, GError **error)
 {
 
-    gchar *tagname = g_strdup_printf("osxcart-rtf-language-%i", language);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_LANGUAGE, language))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_LANGUAGE, language);
         g_object_set(tag,
                      "language", language_to_iso(language),
                      "language-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->language = language;
     return TRUE;
@@ -579,17 +1048,14 @@ doc_li(ParserContext *ctx, Attributes *attr, gint32 twips, GError **error)
     if(twips < 0)
         return TRUE; /* Silently ignore, not supported in GtkTextBuffer */
 
-    gchar *tagname = g_strdup_printf("osxcart-rtf-left-margin-%i", twips);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_LEFT_MARGIN, twips))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_LEFT_MARGIN, twips);
         g_object_set(tag,
                      "left-margin", PANGO_PIXELS(TWIPS_TO_PANGO(twips)),
                      "left-margin-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->left_margin = twips;
     return TRUE;
@@ -598,11 +1064,10 @@ doc_li(ParserContext *ctx, Attributes *attr, gint32 twips, GError **error)
 gboolean
 doc_ltrch(ParserContext *ctx, Attributes *attr, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-left-to-right"))
+    if(should_create_tag(ctx, TAG_LEFT_TO_RIGHT, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-left-to-right");
+        GtkTextTag *tag = create_tag(ctx, TAG_LEFT_TO_RIGHT, 0);
         g_object_set(tag, "direction", GTK_TEXT_DIR_LTR, NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->chardirection = GTK_TEXT_DIR_LTR;
     return TRUE;
@@ -611,11 +1076,10 @@ doc_ltrch(ParserContext *ctx, Attributes *attr, GError **error)
 gboolean
 doc_ltrpar(ParserContext *ctx, Attributes *attr, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-left-to-right"))
+    if(should_create_tag(ctx, TAG_LEFT_TO_RIGHT, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-left-to-right");
+        GtkTextTag *tag = create_tag(ctx, TAG_LEFT_TO_RIGHT, 0);
         g_object_set(tag, "direction", GTK_TEXT_DIR_LTR, NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->pardirection = GTK_TEXT_DIR_LTR;
     return TRUE;
@@ -650,7 +1114,7 @@ doc_pard(ParserContext *ctx, Attributes *attr, GError **error)
     attr->right_margin = 0;
     attr->indent = 0;
     if(attr->tabs)
-        pango_tab_array_free(attr->tabs);
+        tab_stops_unref(attr->tabs);
     attr->tabs = NULL;
     return TRUE;
 }
@@ -680,14 +1144,13 @@ doc_plain(ParserContext *ctx, Attributes *attr, GError **error)
 gboolean
 doc_qc(ParserContext *ctx, Attributes *attr, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-center"))
+    if(should_create_tag(ctx, TAG_CENTER, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-center");
+        GtkTextTag *tag = create_tag(ctx, TAG_CENTER, 0);
         g_object_set(tag,
                      "justification", GTK_JUSTIFY_CENTER,
                      "justification-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->justification = GTK_JUSTIFY_CENTER;
     return TRUE;
@@ -696,14 +1159,13 @@ doc_qc(ParserContext *ctx, Attributes *attr, GError **error)
 gboolean
 doc_qj(ParserContext *ctx, Attributes *attr, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-justified"))
+    if(should_create_tag(ctx, TAG_JUSTIFIED, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-justified");
+        GtkTextTag *tag = create_tag(ctx, TAG_JUSTIFIED, 0);
         g_object_set(tag,
                      "justification", GTK_JUSTIFY_FILL,
                      "justification-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->justification = GTK_JUSTIFY_FILL;
     return TRUE;
@@ -712,14 +1174,13 @@ doc_qj(ParserContext *ctx, Attributes *attr, GError **error)
 gboolean
 doc_ql(ParserContext *ctx, Attributes *attr, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-left"))
+    if(should_create_tag(ctx, TAG_LEFT, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-left");
+        GtkTextTag *tag = create_tag(ctx, TAG_LEFT, 0);
         g_object_set(tag,
                      "justification", GTK_JUSTIFY_LEFT,
                      "justification-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->justification = GTK_JUSTIFY_LEFT;
     return TRUE;
@@ -728,14 +1189,13 @@ doc_ql(ParserContext *ctx, Attributes *attr, GError **error)
 gboolean
 doc_qr(ParserContext *ctx, Attributes *attr, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-right"))
+    if(should_create_tag(ctx, TAG_RIGHT, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-right");
+        GtkTextTag *tag = create_tag(ctx, TAG_RIGHT, 0);
         g_object_set(tag,
                      "justification", GTK_JUSTIFY_RIGHT,
                      "justification-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->justification = GTK_JUSTIFY_RIGHT;
     return TRUE;
@@ -747,17 +1207,14 @@ doc_ri(ParserContext *ctx, Attributes *attr, gint32 twips, GError **error)
     if(twips < 0)
         return TRUE; /* Silently ignore, not supported in GtkTextBuffer */
 
-    gchar *tagname = g_strdup_printf("osxcart-rtf-right-margin-%i", twips);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_RIGHT_MARGIN, twips))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_RIGHT_MARGIN, twips);
         g_object_set(tag,
                      "right-margin", PANGO_PIXELS(TWIPS_TO_PANGO(twips)),
                      "right-margin-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->right_margin = twips;
     return TRUE;
@@ -777,11 +1234,10 @@ doc_rtf(ParserContext *ctx, Attributes *attr, gint32 version, GError **error)
 gboolean
 doc_rtlch(ParserContext *ctx, Attributes *attr, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-right-to-left"))
+    if(should_create_tag(ctx, TAG_RIGHT_TO_LEFT, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-right-to-left");
+        GtkTextTag *tag = create_tag(ctx, TAG_RIGHT_TO_LEFT, 0);
         g_object_set(tag, "direction", GTK_TEXT_DIR_RTL, NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->chardirection = GTK_TEXT_DIR_RTL;
     return TRUE;
@@ -790,11 +1246,10 @@ doc_rtlch(ParserContext *ctx, Attributes *attr, GError **error)
 gboolean
 doc_rtlpar(ParserContext *ctx, Attributes *attr, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-right-to-left"))
+    if(should_create_tag(ctx, TAG_RIGHT_TO_LEFT, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-right-to-left");
+        GtkTextTag *tag = create_tag(ctx, TAG_RIGHT_TO_LEFT, 0);
         g_object_set(tag, "direction", GTK_TEXT_DIR_RTL, NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->pardirection = GTK_TEXT_DIR_RTL;
     return TRUE;
@@ -803,14 +1258,11 @@ doc_rtlpar(ParserContext *ctx, Attributes *attr, GError **error)
 gboolean
 doc_s(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    gchar *tagname = g_strdup_printf("osxcart-rtf-style-%i", param);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(!style_is_defined(ctx, param))
     {
         g_warning(_("Style '%i' undefined"), param);
-        g_free(tagname);
         return TRUE;
     }
-    g_free(tagname);
     attr->style = param;
     return TRUE;
 }
@@ -821,17 +1273,14 @@ doc_sa(ParserContext *ctx, Attributes *attr, gint32 twips, GError **error)
     if(twips < 0)
         return TRUE; /* Silently ignore, not supported in GtkTextBuffer */
 
-    gchar *tagname = g_strdup_printf("osxcart-rtf-space-after-%i", twips);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_SPACE_AFTER, twips))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_SPACE_AFTER, twips);
         g_object_set(tag,
                      "pixels-below-lines", PANGO_PIXELS(TWIPS_TO_PANGO(twips)),
                      "pixels-below-lines-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->space_after = twips;
     return TRUE;
@@ -850,17 +1299,14 @@ doc_sb(ParserContext *ctx, Attributes *attr, gint32 twips, GError **error)
     if(twips < 0)
         return TRUE; /* Silently ignore, not supported in GtkTextBuffer */
 
-    gchar *tagname = g_strdup_printf("osxcart-rtf-space-before-%i", twips);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_SPACE_BEFORE, twips))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_SPACE_BEFORE, twips);
         g_object_set(tag,
                      "pixels-above-lines", PANGO_PIXELS(TWIPS_TO_PANGO(twips)),
                      "pixels-above-lines-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->space_before = twips;
     return TRUE;
@@ -876,14 +1322,13 @@ doc_sbauto(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 gboolean
 doc_scaps(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-smallcaps"))
+    if(should_create_tag(ctx, TAG_SMALLCAPS, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-smallcaps");
+        GtkTextTag *tag = create_tag(ctx, TAG_SMALLCAPS, 0);
         g_object_set(tag,
                      "variant", PANGO_VARIANT_SMALL_CAPS,
                      "variant-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->smallcaps = (param != 0);
     return TRUE;
@@ -895,17 +1340,14 @@ doc_slleading(ParserContext *ctx, Attributes *attr, gint32 twips, GError **error
     if(twips < 0)
         return TRUE; /* Silently ignore, not supported in GtkTextBuffer */
 
-    gchar *tagname = g_strdup_printf("osxcart-rtf-leading-%i", twips);
-    if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+    if(should_create_tag(ctx, TAG_LEADING, twips))
     {
-        GtkTextTag *tag = gtk_text_tag_new(tagname);
+        GtkTextTag *tag = create_tag(ctx, TAG_LEADING, twips);
         g_object_set(tag,
                      "pixels-inside-wrap", PANGO_PIXELS(TWIPS_TO_PANGO(twips)),
                      "pixels-inside-wrap-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
-    g_free(tagname);
 
     attr->leading = twips;
     return TRUE;
@@ -914,14 +1356,13 @@ doc_slleading(ParserContext *ctx, Attributes *attr, gint32 twips, GError **error
 gboolean
 doc_strike(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-strikethrough"))
+    if(should_create_tag(ctx, TAG_STRIKETHROUGH, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-strikethrough");
+        GtkTextTag *tag = create_tag(ctx, TAG_STRIKETHROUGH, 0);
         g_object_set(tag,
                      "strikethrough", TRUE,
                      "strikethrough-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->strikethrough = (param != 0);
     return TRUE;
@@ -930,16 +1371,15 @@ doc_strike(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 gboolean
 doc_sub(ParserContext *ctx, Attributes *attr, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-subscript"))
+    if(should_create_tag(ctx, TAG_SUBSCRIPT, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-subscript");
+        GtkTextTag *tag = create_tag(ctx, TAG_SUBSCRIPT, 0);
         g_object_set(tag,
                      "rise", POINTS_TO_PANGO(-6),
                      "rise-set", TRUE,
                      "scale", PANGO_SCALE_X_SMALL,
                      "scale-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->subscript = TRUE;
     return TRUE;
@@ -948,16 +1388,15 @@ doc_sub(ParserContext *ctx, Attributes *attr, GError **error)
 gboolean
 doc_super(ParserContext *ctx, Attributes *attr, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-superscript"))
+    if(should_create_tag(ctx, TAG_SUPERSCRIPT, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-superscript");
+        GtkTextTag *tag = create_tag(ctx, TAG_SUPERSCRIPT, 0);
         g_object_set(tag,
                      "rise", POINTS_TO_PANGO(6),
                      "rise-set", TRUE,
                      "scale", PANGO_SCALE_X_SMALL,
                      "scale-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->superscript = TRUE;
     return TRUE;
@@ -970,16 +1409,17 @@ doc_tx(ParserContext *ctx, Attributes *attr, gint32 twips, GError **error)
 
     if(attr->tabs == NULL)
     {
-        attr->tabs = pango_tab_array_new(1, FALSE);
+        attr->tabs = tab_stops_new();
         tab_index = 0;
     }
     else
     {
-        tab_index = pango_tab_array_get_size(attr->tabs);
-        pango_tab_array_resize(attr->tabs, tab_index + 1);
+        attr->tabs = tab_stops_make_writable(attr->tabs);
+        tab_index = pango_tab_array_get_size(attr->tabs->array);
+        pango_tab_array_resize(attr->tabs->array, tab_index + 1);
     }
 
-    pango_tab_array_set_tab(attr->tabs, tab_index, PANGO_TAB_LEFT, TWIPS_TO_PANGO(twips));
+    pango_tab_array_set_tab(attr->tabs->array, tab_index, PANGO_TAB_LEFT, TWIPS_TO_PANGO(twips));
 
     return TRUE;
 }
@@ -1023,14 +1463,13 @@ doc_ud(ParserContext *ctx, Attributes *attr, GError **error)
 gboolean
 doc_ul(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-underline-single"))
+    if(should_create_tag(ctx, TAG_UNDERLINE_SINGLE, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-underline-single");
+        GtkTextTag *tag = create_tag(ctx, TAG_UNDERLINE_SINGLE, 0);
         g_object_set(tag,
                      "underline", PANGO_UNDERLINE_SINGLE,
                      "underline-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->underline = param? PANGO_UNDERLINE_SINGLE : PANGO_UNDERLINE_NONE;
     return TRUE;
@@ -1039,14 +1478,13 @@ doc_ul(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 gboolean
 doc_uldb(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-underline-double"))
+    if(should_create_tag(ctx, TAG_UNDERLINE_DOUBLE, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-underline-double");
+        GtkTextTag *tag = create_tag(ctx, TAG_UNDERLINE_DOUBLE, 0);
         g_object_set(tag,
                      "underline", PANGO_UNDERLINE_DOUBLE,
                      "underline-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->underline = param? PANGO_UNDERLINE_DOUBLE : PANGO_UNDERLINE_NONE;
     return TRUE;
@@ -1075,14 +1513,13 @@ doc_ulstyle(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 gboolean
 doc_ulwave(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-underline-wave"))
+    if(should_create_tag(ctx, TAG_UNDERLINE_WAVE, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-underline-wave");
+        GtkTextTag *tag = create_tag(ctx, TAG_UNDERLINE_WAVE, 0);
         g_object_set(tag,
                      "underline", PANGO_UNDERLINE_ERROR,
                      "underline-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->underline = param? PANGO_UNDERLINE_ERROR : PANGO_UNDERLINE_NONE;
     return TRUE;
@@ -1093,17 +1530,14 @@ doc_up(ParserContext *ctx, Attributes *attr, gint32 halfpoints, GError **error)
 {
     if(halfpoints != 0)
     {
-        gchar *tagname = g_strdup_printf("osxcart-rtf-up-%i", halfpoints);
-        if(!gtk_text_tag_table_lookup(ctx->tags, tagname))
+        if(should_create_tag(ctx, TAG_UP, halfpoints))
         {
-            GtkTextTag *tag = gtk_text_tag_new(tagname);
+            GtkTextTag *tag = create_tag(ctx, TAG_UP, halfpoints);
             g_object_set(tag,
                          "rise", HALF_POINTS_TO_PANGO(halfpoints),
                          "rise-set", TRUE,
                          NULL);
-            gtk_text_tag_table_add(ctx->tags, tag);
         }
-        g_free(tagname);
     }
 
     attr->rise = halfpoints;
@@ -1120,14 +1554,13 @@ doc_upr(ParserContext *ctx, Attributes *attr, GError **error)
 gboolean
 doc_v(ParserContext *ctx, Attributes *attr, gint32 param, GError **error)
 {
-    if(!gtk_text_tag_table_lookup(ctx->tags, "osxcart-rtf-invisible"))
+    if(should_create_tag(ctx, TAG_INVISIBLE, 0))
     {
-        GtkTextTag *tag = gtk_text_tag_new("osxcart-rtf-invisible");
+        GtkTextTag *tag = create_tag(ctx, TAG_INVISIBLE, 0);
         g_object_set(tag,
                      "invisible", TRUE,
                      "invisible-set", TRUE,
                      NULL);
-        gtk_text_tag_table_add(ctx->tags, tag);
     }
     attr->invisible = (param != 0);
     return TRUE;
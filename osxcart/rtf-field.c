@@ -103,13 +103,17 @@ DEFINE_SIMPLE_STATE_FUNCTIONS(FieldState, field)
 DEFINE_ATTR_STATE_FUNCTIONS(Attributes, fldrslt)
 
 const ControlWord field_instruction_word_table[] = {
-    { "\\", SPECIAL_CHARACTER, FALSE, NULL, 0, "\\" },
+    { "\\", SPECIAL_CHARACTER, 0, NULL, 0, "\\" },
     { NULL }
 };
 
+static gsize field_instruction_word_index = 0;
+
 const DestinationInfo field_instruction_destination = {
     field_instruction_word_table,
+    &field_instruction_word_index,
     field_instruction_text,
+    sizeof(FieldInstructionState),
     fldinst_state_new,
     fldinst_state_copy,
     fldinst_state_free,
@@ -121,9 +125,13 @@ const ControlWord field_result_word_table[] = {
     { NULL }
 };
 
+static gsize field_result_word_index = 0;
+
 const DestinationInfo field_result_destination = {
     field_result_word_table,
+    &field_result_word_index,
     document_text,
+    sizeof(Attributes),
     fldrslt_state_new,
     fldrslt_state_copy,
     fldrslt_state_free
@@ -133,14 +141,18 @@ typedef gboolean FieldFunc(ParserContext *, FieldState *, GError **);
 static FieldFunc field_fldrslt;
 
 const ControlWord field_word_table[] = {
-    { "*fldinst", DESTINATION, FALSE, NULL, 0, NULL, &field_instruction_destination },
-    { "fldrslt", NO_PARAMETER, FALSE, field_fldrslt },
+    { "*fldinst", DESTINATION, 0, NULL, 0, NULL, &field_instruction_destination },
+    { "fldrslt", NO_PARAMETER, PEEK_STATE, field_fldrslt },
     { NULL }
 };
 
+static gsize field_word_index = 0;
+
 const DestinationInfo field_destination = {
     field_word_table,
+    &field_word_index,
     ignore_pending_text,
+    sizeof(FieldState),
     field_state_new,
     field_state_copy,
     field_state_free
@@ -379,8 +391,8 @@ static void field_instruction_end(ParserContext *ctx)
         }
     }
 
-    Destination *fielddest = g_queue_peek_nth(ctx->destination_stack, 1);
-    FieldState *fieldstate = g_queue_peek_tail(fielddest->state_stack);
+    Destination *fielddest = get_destination(ctx, 1);
+    FieldState *fieldstate = get_destination_initial_state(fielddest);
 
     switch(state->type)
     {
@@ -521,11 +533,11 @@ static gboolean
 field_fldrslt(ParserContext *ctx, FieldState *state, GError **error)
 {
     if(state->ignore_field_result)
-        push_new_destination(ctx, &ignore_destination, NULL);
+        return skip_destination(ctx, error);
     else
     {
-        Destination *outerdest = g_queue_peek_nth(ctx->destination_stack, 1);
-        Attributes *attr = g_queue_peek_head(outerdest->state_stack);
+        Destination *outerdest = get_destination(ctx, 1);
+        gconstpointer attr = peek_destination_state(outerdest);
         push_new_destination(ctx, &field_result_destination, attr);
     }
     return TRUE;
@@ -55,16 +55,16 @@ static FontParamFunc ft_f, ft_fcharset;
 
 const ControlWord fonttbl_word_table[] = {
     SPECIAL_CHARACTER_CONTROL_WORDS,
-    { "f", REQUIRED_PARAMETER, TRUE, ft_f },
-    { "fbidi", NO_PARAMETER, TRUE, ft_fbidi },
-    { "fcharset", REQUIRED_PARAMETER, TRUE, ft_fcharset },
-    { "fdecor", NO_PARAMETER, TRUE, ft_fdecor },
-    { "fmodern", NO_PARAMETER, TRUE, ft_fmodern },
-    { "fnil", NO_PARAMETER, TRUE, ft_fnil },
-    { "froman", NO_PARAMETER, TRUE, ft_froman },
-    { "fscript", NO_PARAMETER, TRUE, ft_fscript },
-    { "fswiss", NO_PARAMETER, TRUE, ft_fswiss },
-    { "ftech", NO_PARAMETER, TRUE, ft_ftech },
+    { "f", REQUIRED_PARAMETER, FLUSH_BUFFER, ft_f },
+    { "fbidi", NO_PARAMETER, FLUSH_BUFFER, ft_fbidi },
+    { "fcharset", REQUIRED_PARAMETER, FLUSH_BUFFER, ft_fcharset },
+    { "fdecor", NO_PARAMETER, FLUSH_BUFFER, ft_fdecor },
+    { "fmodern", NO_PARAMETER, FLUSH_BUFFER, ft_fmodern },
+    { "fnil", NO_PARAMETER, FLUSH_BUFFER, ft_fnil },
+    { "froman", NO_PARAMETER, FLUSH_BUFFER, ft_froman },
+    { "fscript", NO_PARAMETER, FLUSH_BUFFER, ft_fscript },
+    { "fswiss", NO_PARAMETER, FLUSH_BUFFER, ft_fswiss },
+    { "ftech", NO_PARAMETER, FLUSH_BUFFER, ft_ftech },
     { NULL }
 };
 
@@ -75,9 +75,13 @@ const ControlWord fonttbl_word_table[] = {
 #define FONTTBL_FREE g_free(state->name);
 DEFINE_STATE_FUNCTIONS_FULL(FontTableState, fonttbl, FONTTBL_NEW, FONTTBL_COPY, FONTTBL_FREE);
 
+static gsize fonttbl_word_index = 0;
+
 const DestinationInfo fonttbl_destination = {
     fonttbl_word_table,
+    &fonttbl_word_index,
     font_table_text,
+    sizeof(FontTableState),
     fonttbl_state_new,
     fonttbl_state_copy,
     fonttbl_state_free,
@@ -89,7 +93,7 @@ const DestinationInfo fonttbl_destination = {
 static void
 font_table_text(ParserContext *ctx)
 {
-    gchar *name, *semicolon, *tagname, *fontstring = NULL;
+    gchar *name, *semicolon, *tagname;
     FontProperties *fontprop;
     FontTableState *state = (FontTableState *)get_state(ctx);
     GtkTextTag *tag;
@@ -121,36 +125,36 @@ font_table_text(ParserContext *ctx)
     fontprop->index = state->index;
     fontprop->codepage = state->codepage;
     fontprop->font_name = g_strconcat(state->name, name, NULL);
-    ctx->font_table = g_slist_prepend(ctx->font_table, fontprop);
-
-    /* Add the tag to the buffer right now instead of when the font is used,
-    since any font might be declared the default font; remove any previous font
-    with this font table index first */
-    tagname = g_strdup_printf("osxcart-rtf-font-%i", state->index);
-    if((tag = gtk_text_tag_table_lookup(ctx->tags, tagname)))
-        gtk_text_tag_table_remove(ctx->tags, tag);
-    tag = gtk_text_tag_new(tagname);
-
     if(fontprop->font_name && font_suggestions[state->family])
-        fontstring = g_strconcat(fontprop->font_name,
-                                 ",",
-                                 font_suggestions[state->family],
-                                 NULL);
+        fontprop->family = g_strconcat(fontprop->font_name,
+                                       ",",
+                                       font_suggestions[state->family],
+                                       NULL);
     else if(fontprop->font_name)
-        fontstring = g_strdup(fontprop->font_name);
+        fontprop->family = g_strdup(fontprop->font_name);
     else if(font_suggestions[state->family])
-        fontstring = g_strdup(font_suggestions[state->family]);
+        fontprop->family = g_strdup(font_suggestions[state->family]);
+    g_hash_table_replace(ctx->font_table, GINT_TO_POINTER(fontprop->index), fontprop);
 
-    if(fontstring)
+    /* Add the tag to the buffer right now instead of when the font is used,
+    since any font might be declared the default font; remove any previous font
+    with this font table index first. Merged tags get the font family from the
+    font table instead. */
+    if(!ctx->options.merge_tags)
     {
-        g_object_set(tag,
-                     "family", fontstring,
-                     "family-set", TRUE,
-                     NULL);
-        g_free(fontstring);
+        tagname = g_strdup_printf("osxcart-rtf-font-%i", state->index);
+        if((tag = gtk_text_tag_table_lookup(ctx->tags, tagname)))
+            gtk_text_tag_table_remove(ctx->tags, tag);
+        uncache_tag(ctx, TAG_FONT, state->index);
+        tag = gtk_text_tag_new(tagname);
+        if(fontprop->family)
+            g_object_set(tag,
+                         "family", fontprop->family,
+                         "family-set", TRUE,
+                         NULL);
+        gtk_text_tag_table_add(ctx->tags, tag);
+        g_free(tagname);
     }
-    gtk_text_tag_table_add(ctx->tags, tag);
-    g_free(tagname);
 
     g_free(state->name);
     state->index = 0;
@@ -214,7 +218,7 @@ that entry's \fcharset */
 static gint
 font_table_get_codepage(ParserContext *ctx)
 {
-    FontTableState *state = get_state(ctx);
+    const FontTableState *state = peek_state(ctx);
     return state->codepage;
 }
 
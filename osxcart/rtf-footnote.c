@@ -33,9 +33,13 @@ const ControlWord footnote_word_table[] = {
 
 DEFINE_ATTR_STATE_FUNCTIONS(Attributes, footnote)
 
+static gsize footnote_word_index = 0;
+
 const DestinationInfo footnote_destination = {
     footnote_word_table,
+    &footnote_word_index,
     footnote_text,
+    sizeof(Attributes),
     footnote_state_new,
     footnote_state_copy,
     footnote_state_free,
@@ -50,13 +54,13 @@ footnote_text(ParserContext *ctx)
 {
     GtkTextIter start, end;
     GtkTextMark *placeholder;
-    Attributes *attr;
+    const Attributes *attr;
     int length;
     gchar *text;
 
     g_assert(ctx != NULL);
 
-    attr = get_state(ctx);
+    attr = peek_state(ctx);
     text = ctx->text->str;
 
     if(text[0] == '\0')
@@ -17,13 +17,19 @@ with Osxcart.  If not, see <http://www.gnu.org/licenses/>. */
 #include "rtf-deserialize.h"
 #include "rtf-ignore.h"
 
-/* rtf-ignore.c - Used to ignore destinations that are not implemented */
+/* rtf-ignore.c - Used to ignore destinations that are not implemented. The
+parser doesn't push this destination; it skips the group without parsing it
+instead, see skip_destination(). */
 
 const ControlWord ignore_word_table[] = {{ NULL }};
 
+static gsize ignore_word_index = 0;
+
 const DestinationInfo ignore_destination = {
     ignore_word_table,
+    &ignore_word_index,
     ignore_pending_text,
+    0, /* no state */
     ignore_state_new,
     ignore_state_copy,
     ignore_state_free
@@ -35,16 +41,14 @@ ignore_pending_text(ParserContext *ctx)
     g_string_truncate(ctx->text, 0);
 }
 
-gpointer
-ignore_state_new(void)
+void
+ignore_state_new(gpointer state)
 {
-    return NULL;
 }
 
-gpointer
-ignore_state_copy(gconstpointer state)
+void
+ignore_state_copy(gconstpointer state, gpointer copy)
 {
-    return NULL;
 }
 
 void
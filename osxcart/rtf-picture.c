@@ -13,9 +13,9 @@ PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
 You should have received a copy of the GNU Lesser General Public License along
 with Osxcart.  If not, see <http://www.gnu.org/licenses/>. */
 
+#include <math.h>
 #include <string.h>
 #include <stdlib.h>
-#include <errno.h>
 #include <glib.h>
 #include <config.h>
 #include <glib/gi18n-lib.h>
@@ -42,7 +42,7 @@ typedef enum {
 typedef struct {
     PictType type;
     gint type_param;
-    GdkPixbufLoader *loader;
+    GByteArray *data;
     gboolean error;
 
     glong width;
@@ -51,6 +51,7 @@ typedef struct {
     glong height_goal;
     gint xscale;
     gint yscale;
+    gint high_nibble; /* First digit of a hex byte split over two runs, or -1 */
 } PictState;
 
 typedef struct {
@@ -58,10 +59,46 @@ typedef struct {
     glong height;
 } NeXTGraphicState;
 
+/* A picture waiting to be decoded, possibly in another thread, and inserted
+into the text buffer at 'mark' once the whole document has been parsed or, with
+lazy pictures, once it is materialized. The picture is either encoded in 'data'
+or, for a \NeXTGraphic, loaded from 'filename'. */
+typedef struct {
+    PictType type;
+    GByteArray *data;
+    gchar *filename;
+    gint width;
+    gint height;
+    gint xscale;
+    gint yscale;
+    guint64 max_pixels; /* 0 for no limit */
+    gboolean too_large; /* Decoding was aborted because of max_pixels */
+    GtkTextMark *mark;
+    GdkPixbuf *pixbuf;
+} PictureJob;
+
+/* Object replacement character, U+FFFC */
+#define PICT_PLACEHOLDER "\xEF\xBF\xBC"
+
+/* Key under which a lazy picture's child anchor holds its PictureJob */
+#define PICT_JOB_KEY "osxcart-rtf-picture"
+
+/* Number of threads decoding pictures */
+#if GLIB_CHECK_VERSION(2,36,0)
+#define PICT_DECODING_THREADS g_get_num_processors()
+#else
+#define PICT_DECODING_THREADS 4
+#endif
+
+/* Values in the hexadecimal decoding table that aren't digits */
+#define HEX_SPACE (-1)
+#define HEX_INVALID (-2)
+
 #define PICT_STATE_INIT \
     state->type = PICT_TYPE_WMF; \
     state->type_param = 1; \
     state->xscale = state->yscale = 100; \
+    state->high_nibble = -1; \
     state->width = state->height = state->width_goal = state->height_goal = -1;
 DEFINE_STATE_FUNCTIONS_WITH_INIT(PictState, pict, PICT_STATE_INIT)
 #define NEXTGRAPHIC_STATE_INIT state->width = state->height = -1;
@@ -70,6 +107,8 @@ DEFINE_STATE_FUNCTIONS_WITH_INIT(NeXTGraphicState, nextgraphic, NEXTGRAPHIC_STAT
 /* Forward declarations */
 static void pict_text(ParserContext *ctx);
 static void pict_end(ParserContext *ctx);
+static void pict_binary_data(ParserContext *ctx, const guchar *data, gsize length);
+static void pict_plain_text(ParserContext *ctx, const gchar *text, gsize length);
 static void nextgraphic_text(ParserContext *ctx);
 static void nextgraphic_end(ParserContext *ctx);
 static gint nextgraphic_get_codepage(ParserContext *ctx);
@@ -87,41 +126,52 @@ typedef gboolean NeXTGraphicParamFunc(ParserContext *, NeXTGraphicState *, gint3
 static NeXTGraphicParamFunc ng_height, ng_width;
 
 const ControlWord pict_word_table[] = {
-    { "dibitmap", REQUIRED_PARAMETER, FALSE, pic_dibitmap },
-    { "emfblip", NO_PARAMETER, FALSE, pic_emfblip },
-    { "jpegblip", NO_PARAMETER, FALSE, pic_jpegblip },
-    { "macpict", NO_PARAMETER, FALSE, pic_macpict },
-    { "pich", REQUIRED_PARAMETER, FALSE, pic_pich },
-    { "pichgoal", REQUIRED_PARAMETER, FALSE, pic_pichgoal },
-    { "picscalex", OPTIONAL_PARAMETER, FALSE, pic_picscalex, 100 },
-    { "picscaley", OPTIONAL_PARAMETER, FALSE, pic_picscaley, 100 },
-    { "picw", REQUIRED_PARAMETER, FALSE, pic_picw },
-    { "picwgoal", REQUIRED_PARAMETER, FALSE, pic_picwgoal },
-    { "pmmetafile", REQUIRED_PARAMETER, FALSE, pic_pmmetafile },
-    { "pngblip", NO_PARAMETER, FALSE, pic_pngblip },
-    { "wbitmap", REQUIRED_PARAMETER, FALSE, pic_wbitmap },
-    { "wmetafile", OPTIONAL_PARAMETER, FALSE, pic_wmetafile, 1 },
+    { "dibitmap", REQUIRED_PARAMETER, 0, pic_dibitmap },
+    { "emfblip", NO_PARAMETER, 0, pic_emfblip },
+    { "jpegblip", NO_PARAMETER, 0, pic_jpegblip },
+    { "macpict", NO_PARAMETER, 0, pic_macpict },
+    { "pich", REQUIRED_PARAMETER, 0, pic_pich },
+    { "pichgoal", REQUIRED_PARAMETER, 0, pic_pichgoal },
+    { "picscalex", OPTIONAL_PARAMETER, 0, pic_picscalex, 100 },
+    { "picscaley", OPTIONAL_PARAMETER, 0, pic_picscaley, 100 },
+    { "picw", REQUIRED_PARAMETER, 0, pic_picw },
+    { "picwgoal", REQUIRED_PARAMETER, 0, pic_picwgoal },
+    { "pmmetafile", REQUIRED_PARAMETER, 0, pic_pmmetafile },
+    { "pngblip", NO_PARAMETER, 0, pic_pngblip },
+    { "wbitmap", REQUIRED_PARAMETER, 0, pic_wbitmap },
+    { "wmetafile", OPTIONAL_PARAMETER, 0, pic_wmetafile, 1 },
     { NULL }
 };
 
+static gsize pict_word_index = 0;
+
 const DestinationInfo pict_destination = {
     pict_word_table,
+    &pict_word_index,
     pict_text,
+    sizeof(PictState),
     pict_state_new,
     pict_state_copy,
     pict_state_free,
-    pict_end
+    pict_end,
+    NULL, /* codepage doesn't matter */
+    pict_binary_data,
+    pict_plain_text
 };
 
 const ControlWord nextgraphic_word_table[] = {
-    { "height", REQUIRED_PARAMETER, FALSE, ng_height },
-    { "width", REQUIRED_PARAMETER, FALSE, ng_width },
+    { "height", REQUIRED_PARAMETER, 0, ng_height },
+    { "width", REQUIRED_PARAMETER, 0, ng_width },
     { NULL }
 };
 
+static gsize nextgraphic_word_index = 0;
+
 const DestinationInfo nextgraphic_destination = {
     nextgraphic_word_table,
+    &nextgraphic_word_index,
     nextgraphic_text,
+    sizeof(NeXTGraphicState),
     nextgraphic_state_new,
     nextgraphic_state_copy,
     nextgraphic_state_free,
@@ -130,158 +180,569 @@ const DestinationInfo nextgraphic_destination = {
 };
 
 const ControlWord shppict_word_table[] = {
-    { "pict", DESTINATION, FALSE, NULL, 0, NULL, &pict_destination },
+    { "pict", DESTINATION, 0, NULL, 0, NULL, &pict_destination },
     { NULL }
 };
 
+static gsize shppict_word_index = 0;
+
 const DestinationInfo shppict_destination = {
     shppict_word_table,
+    &shppict_word_index,
     ignore_pending_text,
+    0, /* no state */
     ignore_state_new,
     ignore_state_copy,
     ignore_state_free
 };
 
-/* Insert picture into text buffer at current insertion mark */
+static const char *pict_mime_types[] = {
+    "image/x-emf", "image/png", "image/jpeg", "image/x-pict",
+    "OS/2 Presentation Manager", "image/x-wmf", "image/x-bmp", "image-x-bmp"
+}; /* "OS/2 Presentation Manager" isn't supported */
+
+/* Work out the size at which to load a picture whose real size is 'width' by
+'height' pixels: its declared size if it has one, scaled, and shrunk to fit
+within its maximum number of pixels */
 static void
-insert_picture_into_textbuffer(ParserContext *ctx, GdkPixbuf *pixbuf)
+get_picture_size(PictureJob *job, gint width, gint height, gint *new_width, gint *new_height)
 {
-    GtkTextIter iter;
-    gtk_text_buffer_get_iter_at_mark(ctx->textbuffer, &iter, ctx->endmark);
-    gtk_text_buffer_insert_pixbuf(ctx->textbuffer, &iter, pixbuf);
+    gint64 scaled_width = (job->width != -1)? job->width : width;
+    gint64 scaled_height = (job->height != -1)? job->height : height;
+    gdouble pixels;
+
+    scaled_width = scaled_width * job->xscale / 100;
+    scaled_height = scaled_height * job->yscale / 100;
+
+    pixels = (gdouble)scaled_width * scaled_height;
+    if(job->max_pixels > 0 && pixels > job->max_pixels)
+    {
+        gdouble factor = sqrt(job->max_pixels / pixels);
+        scaled_width = (gint64)(scaled_width * factor);
+        scaled_height = (gint64)(scaled_height * factor);
+    }
+
+    *new_width = (gint)CLAMP(scaled_width, 1, G_MAXINT);
+    *new_height = (gint)CLAMP(scaled_height, 1, G_MAXINT);
+}
+
+/* Returns whether a picture whose real size is 'width' by 'height' pixels can
+be decoded without going over the job's maximum number of pixels. Only the JPEG
+loader decodes straight to a smaller size, at down to 1/8 of the real width and
+height; the other loaders decode the whole picture and scale it afterwards. If
+the picture is too large, warns about it. */
+static gboolean
+check_decoded_size(PictureJob *job, gint width, gint height, gboolean is_jpeg)
+{
+    guint64 pixels = (guint64)width * height;
+
+    if(is_jpeg)
+        pixels /= 64;
+    if(job->max_pixels == 0 || pixels <= job->max_pixels)
+        return TRUE;
+    g_warning(_("Picture not loaded, because it is %d by %d pixels, more than the maximum number of pixels"), width, height);
+    return FALSE;
 }
 
-/* Send a message to the GdkPixbufLoader to change its expected size after
-parsing a width or height declaration */
+/* Tell the GdkPixbufLoader what size to load the picture at, once it knows the
+picture's real size. If decoding the picture would take more than the maximum
+number of pixels, abort it instead by setting the size to zero. */
 static void
-adjust_loader_size(PictState *state)
+adjust_loader_size(GdkPixbufLoader *loader, gint width, gint height, PictureJob *job)
 {
-    if(state->loader && (state->width != -1 || state->width_goal != -1) && (state->height != -1 || state->height_goal != -1))
-        gdk_pixbuf_loader_set_size(state->loader,
-                                   (state->width_goal != -1)? state->width_goal : state->width,
-                                   (state->height_goal != -1)? state->height_goal : state->height);
+    if(!check_decoded_size(job, width, height, job->type == PICT_TYPE_JPEG))
+    {
+        job->too_large = TRUE;
+        gdk_pixbuf_loader_set_size(loader, 0, 0);
+        return;
+    }
+    get_picture_size(job, width, height, &width, &height);
+    gdk_pixbuf_loader_set_size(loader, width, height);
+}
+
+/* Returns whether the MIME type for pictures of type 'type' is present in the
+list of formats compiled into our GdkPixbuf library. The list is only looked
+through once per process. */
+static gboolean
+picture_type_is_available(PictType type)
+{
+    static gsize available_types = 0; /* Bit mask of PictTypes, plus 1 */
+
+    if(g_once_init_enter(&available_types))
+    {
+        GSList *formats, *iter;
+        gsize available = 0;
+        guint i, j;
+
+        formats = gdk_pixbuf_get_formats();
+        for(iter = formats; iter; iter = g_slist_next(iter))
+        {
+            gchar **mimes = gdk_pixbuf_format_get_mime_types(iter->data);
+
+            for(i = 0; mimes[i] != NULL; i++)
+                for(j = 0; j < G_N_ELEMENTS(pict_mime_types); j++)
+                    if(g_ascii_strcasecmp(mimes[i], pict_mime_types[j]) == 0)
+                        available |= 1 << j;
+            g_strfreev(mimes);
+        }
+        g_slist_free(formats);
+
+        g_once_init_leave(&available_types, available + 1);
+    }
+
+    return ((available_types - 1) & (1 << type)) != 0;
+}
+
+/* Start collecting picture data for the picture type in 'state', if that
+hasn't been done yet. Returns FALSE if the picture can't be loaded. */
+static gboolean
+ensure_picture_data(PictState *state)
+{
+    if(state->error)
+        return FALSE;
+    if(state->data)
+        return TRUE;
+
+    if(!picture_type_is_available(state->type))
+    {
+        g_warning(_("Module for loading MIME type '%s' not found"), pict_mime_types[state->type]);
+        state->error = TRUE;
+        return FALSE;
+    }
+
+    state->data = g_byte_array_new();
+    return TRUE;
+}
+
+/* Add a chunk of decoded picture data to the picture */
+static void
+write_picture_data(PictState *state, const guchar *data, gsize length)
+{
+    g_byte_array_append(state->data, data, length);
+}
+
+#define X HEX_INVALID
+#define S HEX_SPACE
+/* Value of each byte as a hexadecimal digit. High characters are skipped like
+whitespace, because the parser ignores them everywhere else. */
+static const gint8 hex_values[256] = {
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  S,  S,  S,  S,  S,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     S,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  X,  X,  X,  X,  X,  X,
+     X, 10, 11, 12, 13, 14, 15,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X, 10, 11, 12, 13, 14, 15,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,
+     S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,
+     S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,
+     S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,
+     S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,
+     S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,
+     S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,
+     S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S,  S
+};
+#undef X
+#undef S
+
+/* Decode a run of hexadecimal picture data straight onto the end of the
+picture's data. Whitespace is skipped. If the run ends halfway through a byte,
+the first digit is kept in the state, since the rest of the byte may come after
+a control word or group. */
+static void
+write_hex_picture_data(PictState *state, const gchar *text, gsize length)
+{
+    const guchar *pos = (const guchar *)text, *end = pos + length;
+    gint high_nibble = state->high_nibble;
+    guint start = state->data->len;
+    guchar *out;
+
+    /* Make room for as many bytes as the run can hold */
+    g_byte_array_set_size(state->data, start + (length + 1) / 2);
+    out = state->data->data + start;
+
+    for(; pos < end; pos++)
+    {
+        gint8 value = hex_values[*pos];
+
+        if(value == HEX_SPACE)
+            continue;
+        if(value == HEX_INVALID)
+        {
+            gchar buf[2] = { *pos, '\0' };
+            g_warning(_("Error in \\pict data: '%s'"), buf);
+            state->error = TRUE;
+            break;
+        }
+        if(high_nibble == -1)
+        {
+            high_nibble = value;
+            continue;
+        }
+
+        *out++ = (guchar)(high_nibble << 4 | value);
+        high_nibble = -1;
+    }
+
+    state->high_nibble = high_nibble;
+    g_byte_array_set_size(state->data, out - state->data->data);
 }
 
 /* The "text" in a \pict destination is the picture, expressed as a long string
-of hexadecimal digits */
+of hexadecimal digits. It is decoded directly from the RTF code, as it comes
+in. */
 static void
-pict_text(ParserContext *ctx)
+pict_plain_text(ParserContext *ctx, const gchar *text, gsize length)
 {
-    GError *error = NULL;
     PictState *state = get_state(ctx);
-    guchar *writebuffer;
-    gint count;
-    const char *mimetypes[] = {
-        "image/x-emf", "image/png", "image/jpeg", "image/x-pict",
-        "OS/2 Presentation Manager", "image/x-wmf", "image/x-bmp", "image-x-bmp"
-    }; /* "OS/2 Presentation Manager" isn't supported */
 
-    if(state->error)
+    if(!ensure_picture_data(state))
         return;
+    write_hex_picture_data(state, text, length);
+}
 
-    if(strlen(ctx->text->str) == 0)
+/* Text that ends up in the pending text buffer anyway, for example written as
+\'xx, is decoded in the same way */
+static void
+pict_text(ParserContext *ctx)
+{
+    if(ctx->text->len == 0)
         return;
+    pict_plain_text(ctx, ctx->text->str, ctx->text->len);
+    g_string_truncate(ctx->text, 0);
+}
 
-    /* If no GdkPixbufLoader has been initialized yet, then do that */
-    if(!state->loader)
+/* Picture data may also be given as raw bytes after \binN */
+static void
+pict_binary_data(ParserContext *ctx, const guchar *data, gsize length)
+{
+    PictState *state = get_state(ctx);
+
+    if(!ensure_picture_data(state))
+        return;
+    write_picture_data(state, data, length);
+}
+
+/* Decode a picture with a GdkPixbufLoader at the size it will be displayed
+at. This is called in a worker thread if threads are available. */
+static void
+decode_picture(PictureJob *job, gpointer unused)
+{
+    GError *error = NULL;
+    GdkPixbufLoader *loader;
+    GdkPixbuf *picture;
+
+    if(job->filename)
     {
-        GSList *formats = gdk_pixbuf_get_formats();
-        GSList *iter;
-        gchar **mimes;
+        GdkPixbufFormat *format;
+        gint width, height;
 
-        /* Make sure the MIME type we want to load is present in the list of
-        formats compiled into our GdkPixbuf library */
-        for(iter = formats; iter && !state->loader; iter = g_slist_next(iter))
+        format = gdk_pixbuf_get_file_info(job->filename, &width, &height);
+        if(format)
         {
-            int i;
-            mimes = gdk_pixbuf_format_get_mime_types(iter->data);
+            gchar *name = gdk_pixbuf_format_get_name(format);
+            gboolean fits = check_decoded_size(job, width, height, strcmp(name, "jpeg") == 0);
 
-            for(i = 0; mimes[i] != NULL; i++)
-            if(g_ascii_strcasecmp(mimes[i], mimetypes[state->type]) == 0)
-            {
-                state->loader = gdk_pixbuf_loader_new_with_mime_type(mimetypes[state->type], &error);
-                if(!state->loader)
-                {
-                    g_warning(_("Error loading picture of MIME type '%s': %s"), mimetypes[state->type], error->message);
-                    state->error = TRUE;
-                }
-                break;
-            }
+            g_free(name);
+            if(!fits)
+                return;
+            get_picture_size(job, width, height, &width, &height);
         }
-        if(!state->loader && !state->error)
+        else
+            width = height = -1; /* Let loading the file report the error */
+        job->pixbuf = gdk_pixbuf_new_from_file_at_scale(job->filename, width, height, FALSE /* preserve aspect ratio */, &error);
+        if(!job->pixbuf)
         {
-            g_warning(_("Module for loading MIME type '%s' not found"), mimetypes[state->type]);
-            state->error = TRUE;
+            g_warning(_("Error loading picture from file '%s': %s"), job->filename, error->message);
+            g_error_free(error);
         }
+        return;
+    }
 
-        g_slist_free(formats);
+    loader = gdk_pixbuf_loader_new_with_mime_type(pict_mime_types[job->type], &error);
+    if(!loader)
+    {
+        g_warning(_("Error loading picture of MIME type '%s': %s"), pict_mime_types[job->type], error->message);
+        g_error_free(error);
+        return;
+    }
+    g_signal_connect(loader, "size-prepared", G_CALLBACK(adjust_loader_size), job);
 
-        if(state->error)
-            return;
+    /* If the picture was too large, the loader fails once it has been
+    aborted; that has already been warned about */
+    if(!gdk_pixbuf_loader_write(loader, job->data->data, job->data->len, &error))
+    {
+        if(!job->too_large)
+            g_warning(_("Error reading \\pict data: %s"), error->message);
+        g_clear_error(&error);
+    }
+    if(!gdk_pixbuf_loader_close(loader, &error))
+    {
+        if(!job->too_large)
+            g_warning(_("Error closing pixbuf loader: %s"), error->message);
+        g_clear_error(&error);
+    }
+
+    /* Don't keep anything the loader may have decoded before it was aborted */
+    picture = gdk_pixbuf_loader_get_pixbuf(loader);
+    if(!job->too_large)
+    {
+        if(!picture)
+            g_warning(_("Error loading picture"));
+        else
+            job->pixbuf = g_object_ref(picture);
+    }
+
+    g_object_unref(loader);
+}
+
+static void
+picture_job_free(PictureJob *job)
+{
+    if(job->data)
+        g_byte_array_free(job->data, TRUE);
+    g_free(job->filename);
+    if(job->pixbuf)
+        g_object_unref(job->pixbuf);
+    g_slice_free(PictureJob, job);
+}
 
-        adjust_loader_size(state);
+/* Returns a thread pool for decoding pictures, or NULL if threads aren't
+supported */
+static GThreadPool *
+picture_pool_new(void)
+{
+    if(!g_thread_supported())
+        return NULL;
+    return g_thread_pool_new((GFunc)decode_picture, NULL, PICT_DECODING_THREADS, FALSE, NULL);
+}
+
+/* Decode 'job' in 'pool', or right away if there is no pool */
+static void
+start_decoding_picture(GThreadPool *pool, PictureJob *job)
+{
+    if(pool)
+        g_thread_pool_push(pool, job, NULL);
+    else
+        decode_picture(job, NULL);
+}
+
+/* Insert the picture's placeholder into the text buffer: a child anchor that
+holds the picture job if the picture is lazy, otherwise an object replacement
+character, the same character that stands for a picture in a text buffer. Either
+way the placeholder gets the same attributes as a picture would. Returns TRUE
+if the job is now owned by the child anchor. */
+static gboolean
+insert_picture_placeholder(ParserContext *ctx, PictureJob *job)
+{
+    GtkTextIter iter;
+
+    gtk_text_buffer_get_iter_at_mark(ctx->textbuffer, &iter, ctx->endmark);
+    if(ctx->options.lazy_pictures)
+    {
+        GtkTextChildAnchor *anchor = gtk_text_buffer_create_child_anchor(ctx->textbuffer, &iter);
+        g_object_set_data_full(G_OBJECT(anchor), PICT_JOB_KEY, job, (GDestroyNotify)picture_job_free);
+        return TRUE;
     }
 
-    /* Convert the "text" into binary data */
-    writebuffer = g_new0(guchar, strlen(ctx->text->str));
-    for(count = 0; ctx->text->str[count * 2] && ctx->text->str[count * 2 + 1]; count++)
+    /* The mark stays before the placeholder */
+    job->mark = gtk_text_buffer_create_mark(ctx->textbuffer, NULL, &iter, TRUE);
+    gtk_text_buffer_insert(ctx->textbuffer, &iter, PICT_PLACEHOLDER, -1);
+    return FALSE;
+}
+
+/* Replace the placeholder after the mark of 'job' by its picture, with the same
+tags, or just remove it if the picture couldn't be loaded */
+static void
+replace_picture_placeholder(GtkTextBuffer *buffer, PictureJob *job)
+{
+    GtkTextIter start, end;
+    GSList *tags, *iter;
+
+    gtk_text_buffer_get_iter_at_mark(buffer, &start, job->mark);
+    end = start;
+    gtk_text_iter_forward_char(&end);
+    tags = gtk_text_iter_get_tags(&start);
+    gtk_text_buffer_delete(buffer, &start, &end);
+    if(job->pixbuf)
     {
-        gchar buf[3];
-        guchar byte;
-
-        memcpy(buf, ctx->text->str + (count * 2), 2);
-        buf[2] = '\0';
-        errno = 0;
-        byte = (guchar)strtol(buf, NULL, 16);
-        if(errno)
+        /* The mark stays before the picture and 'start' moves after it */
+        gtk_text_buffer_insert_pixbuf(buffer, &start, job->pixbuf);
+        gtk_text_buffer_get_iter_at_mark(buffer, &end, job->mark);
+        for(iter = tags; iter; iter = g_slist_next(iter))
+            gtk_text_buffer_apply_tag(buffer, iter->data, &end, &start);
+    }
+    g_slist_free(tags);
+    gtk_text_buffer_delete_mark(buffer, job->mark);
+    job->mark = NULL;
+}
+
+/* Give a new picture its share of the document's pixel budget, and insert its
+placeholder; unless the picture is lazy, start decoding it. The picture is
+inserted later by insert_pictures() or materialize_pictures(). */
+static void
+add_picture(ParserContext *ctx, PictureJob *job)
+{
+    job->max_pixels = ctx->options.max_picture_pixels;
+    if(ctx->options.max_document_pixels > 0)
+    {
+        guint64 pixels;
+
+        if(ctx->picture_pixels_left == 0)
         {
-            g_warning(_("Error in \\pict data: '%s'"), buf);
-            state->error = TRUE;
-            g_free(writebuffer);
+            g_warning(_("Picture not loaded, because the document's pictures have more than the maximum number of pixels"));
+            picture_job_free(job);
             return;
         }
-        writebuffer[count] = byte;
+        if(job->max_pixels == 0 || job->max_pixels > ctx->picture_pixels_left)
+            job->max_pixels = ctx->picture_pixels_left;
+
+        /* A picture with a declared size is loaded at that size, so count
+        that; otherwise count the most it may use */
+        pixels = job->max_pixels;
+        if(job->width != -1 && job->height != -1)
+        {
+            gint width, height;
+            get_picture_size(job, job->width, job->height, &width, &height);
+            pixels = MIN(pixels, (guint64)width * height);
+        }
+        ctx->picture_pixels_left -= pixels;
     }
-    /* Write the "text" into the GdkPixbufLoader */
-    if(!gdk_pixbuf_loader_write(state->loader, writebuffer, count, &error))
+
+    if(insert_picture_placeholder(ctx, job))
+        return;
+
+    if(!ctx->pictures)
     {
-        g_warning(_("Error reading \\pict data: %s"), error->message);
-        state->error = TRUE;
+        ctx->pictures = g_ptr_array_new();
+        ctx->picture_pool = picture_pool_new();
     }
-
-    g_free(writebuffer);
-    g_string_truncate(ctx->text, 0);
+    g_ptr_array_add(ctx->pictures, job);
+    start_decoding_picture(ctx->picture_pool, job);
 }
 
-/* When the destination is closed, then there is no more picture data, so close
-the GdkPixbufLoader and load the picture */
+/* When the destination is closed, then there is no more picture data, so add
+the picture to the document */
 static void
 pict_end(ParserContext *ctx)
 {
-    GError *error = NULL;
     PictState *state = get_state(ctx);
+    PictureJob *job;
 
-    if(!state->error)
+    if(state->error || !state->data)
     {
-        if(state->loader && !gdk_pixbuf_loader_close(state->loader, &error))
-            g_warning(_("Error closing pixbuf loader: %s"), error->message);
-        GdkPixbuf *picture = gdk_pixbuf_loader_get_pixbuf(state->loader);
-        if(!picture)
-            g_warning(_("Error loading picture"));
-        else
+        if(state->data)
+            g_byte_array_free(state->data, TRUE);
+        state->data = NULL;
+        return;
+    }
+
+    job = g_slice_new0(PictureJob);
+    job->type = state->type;
+    job->data = state->data;
+    state->data = NULL;
+    if((state->width != -1 || state->width_goal != -1) && (state->height != -1 || state->height_goal != -1))
+    {
+        job->width = (state->width_goal != -1)? state->width_goal : state->width;
+        job->height = (state->height_goal != -1)? state->height_goal : state->height;
+    }
+    else
+        job->width = job->height = -1;
+    job->xscale = state->xscale;
+    job->yscale = state->yscale;
+
+    add_picture(ctx, job);
+}
+
+/* Wait until all the pictures in the document are decoded, and insert them
+into the text buffer where their \pict destinations were */
+void
+insert_pictures(ParserContext *ctx)
+{
+    guint count;
+
+    if(!ctx->pictures)
+        return;
+
+    if(ctx->picture_pool)
+        g_thread_pool_free(ctx->picture_pool, FALSE, TRUE);
+    ctx->picture_pool = NULL;
+
+    for(count = 0; count < ctx->pictures->len; count++)
+    {
+        PictureJob *job = g_ptr_array_index(ctx->pictures, count);
+        replace_picture_placeholder(ctx->textbuffer, job);
+        picture_job_free(job);
+    }
+    g_ptr_array_free(ctx->pictures, TRUE);
+    ctx->pictures = NULL;
+}
+
+static gboolean
+is_placeholder_char(gunichar ch, gpointer unused)
+{
+    return ch == 0xFFFC;
+}
+
+/* Decode the lazy pictures between 'start' and 'end' that were imported with
+the lazy pictures option, and replace their child anchors by the pictures */
+void
+materialize_pictures(GtkTextBuffer *buffer, const GtkTextIter *start, const GtkTextIter *end)
+{
+    GPtrArray *jobs = g_ptr_array_new();
+    GThreadPool *pool = NULL;
+    GtkTextIter iter = *start;
+    guint count;
+
+    /* Collect all the pictures first, since replacing them invalidates the
+    iterators */
+    if(!is_placeholder_char(gtk_text_iter_get_char(&iter), NULL))
+        gtk_text_iter_forward_find_char(&iter, is_placeholder_char, NULL, end);
+    while(gtk_text_iter_compare(&iter, end) < 0)
+    {
+        GtkTextChildAnchor *anchor = gtk_text_iter_get_child_anchor(&iter);
+        PictureJob *job;
+
+        if(anchor && (job = g_object_steal_data(G_OBJECT(anchor), PICT_JOB_KEY)))
         {
-            /* Scale picture if needed */
-            if(state->xscale != 100 || state->yscale != 100)
-            {
-                int newwidth = gdk_pixbuf_get_width(picture) * state->xscale / 100;
-                int newheight = gdk_pixbuf_get_height(picture) * state->yscale / 100;
-                GdkPixbuf *newpicture = gdk_pixbuf_scale_simple(picture, newwidth, newheight, GDK_INTERP_BILINEAR);
-                g_object_unref(picture);
-                picture = newpicture;
-            }
-            insert_picture_into_textbuffer(ctx, picture);
+            job->mark = gtk_text_buffer_create_mark(buffer, NULL, &iter, TRUE);
+            g_ptr_array_add(jobs, job);
+            if(!pool)
+                pool = picture_pool_new();
+            start_decoding_picture(pool, job);
         }
+        gtk_text_iter_forward_find_char(&iter, is_placeholder_char, NULL, end);
     }
+
+    if(pool)
+        g_thread_pool_free(pool, FALSE, TRUE);
+
+    for(count = 0; count < jobs->len; count++)
+    {
+        PictureJob *job = g_ptr_array_index(jobs, count);
+        replace_picture_placeholder(buffer, job);
+        picture_job_free(job);
+    }
+    g_ptr_array_free(jobs, TRUE);
+}
+
+/* Decode the picture of a child anchor that was imported with the lazy pictures
+option, without replacing the anchor, so that it can be exported. Returns a new
+reference to the picture, or NULL if the anchor has no picture or it can't be
+loaded. */
+GdkPixbuf *
+load_lazy_picture(GtkTextChildAnchor *anchor)
+{
+    PictureJob *job = g_object_get_data(G_OBJECT(anchor), PICT_JOB_KEY);
+    GdkPixbuf *pixbuf;
+
+    if(!job)
+        return NULL;
+    decode_picture(job, NULL);
+    pixbuf = job->pixbuf;
+    job->pixbuf = NULL;
+    return pixbuf;
 }
 
 static gboolean
@@ -322,7 +783,6 @@ static gboolean
 pic_pich(ParserContext *ctx, PictState *state, gint32 pixels, GError **error)
 {
     state->height = pixels;
-    adjust_loader_size(state);
     return TRUE;
 }
 
@@ -330,7 +790,6 @@ static gboolean
 pic_pichgoal(ParserContext *ctx, PictState *state, gint32 twips, GError **error)
 {
     state->height_goal = PANGO_PIXELS(TWIPS_TO_PANGO(twips));
-    adjust_loader_size(state);
     return TRUE;
 }
 
@@ -352,7 +811,6 @@ static gboolean
 pic_picw(ParserContext *ctx, PictState *state, gint32 pixels, GError **error)
 {
     state->width = pixels;
-    adjust_loader_size(state);
     return TRUE;
 }
 
@@ -360,7 +818,6 @@ static gboolean
 pic_picwgoal(ParserContext *ctx, PictState *state, gint32 twips, GError **error)
 {
     state->width_goal = PANGO_PIXELS(TWIPS_TO_PANGO(twips));
-    adjust_loader_size(state);
     return TRUE;
 }
 
@@ -407,26 +864,34 @@ nextgraphic_text(ParserContext *ctx)
 {
 }
 
-/* Load the file from the filename in the pending text buffer */
+/* Add the picture from the file named in the pending text buffer to the
+document. The file is loaded later, when the current directory may be
+different, so make the filename absolute. */
 static void
 nextgraphic_end(ParserContext *ctx)
 {
-    GdkPixbuf *pixbuf;
     gchar *filename;
     NeXTGraphicState *state = get_state(ctx);
-    GError *error = NULL;
+    PictureJob *job;
 
     filename = g_strstrip(g_strdup(ctx->text->str));
     g_string_truncate(ctx->text, 0);
-    pixbuf = gdk_pixbuf_new_from_file_at_scale(filename, state->width, state->height, FALSE /* preserve aspect ratio */, &error);
-    if(!pixbuf)
+
+    job = g_slice_new0(PictureJob);
+    if(g_path_is_absolute(filename))
+        job->filename = filename;
+    else
     {
-        g_warning(_("Error loading picture from file '%s': %s"), filename, error->message);
-        return;
+        gchar *cwd = g_get_current_dir();
+        job->filename = g_build_filename(cwd, filename, NULL);
+        g_free(cwd);
+        g_free(filename);
     }
-    g_free(filename);
+    job->width = state->width;
+    job->height = state->height;
+    job->xscale = job->yscale = 100;
 
-    insert_picture_into_textbuffer(ctx, pixbuf);
+    add_picture(ctx, job);
 }
 
 static gint
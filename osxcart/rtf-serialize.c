@@ -17,12 +17,14 @@ with Osxcart.  If not, see <http://www.gnu.org/licenses/>. */
 #include <ctype.h>
 #include <time.h>
 #include <glib.h>
+#include <gio/gio.h>
 #include <config.h>
 #include <glib/gi18n-lib.h>
 #include <gdk/gdk.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <gtk/gtk.h>
 #include "config.h"
+#include "rtf-deserialize.h"
 #include "rtf-langcode.h"
 
 /* rtf-serialize.c - RTF writer */
@@ -32,11 +34,20 @@ with Osxcart.  If not, see <http://www.gnu.org/licenses/>. */
 #define PANGO_TO_HALF_POINTS(pango) (2 * pango / PANGO_SCALE)
 #define PANGO_TO_TWIPS(pango) (20 * pango / PANGO_SCALE)
 
+/* Amount of output collected before it is written to the stream */
+#define WRITE_BUFFER_SIZE 4096
+
 typedef struct {
     GtkTextBuffer *textbuffer;
     const GtkTextIter *start, *end;
     GString *output;
-    GtkTextBuffer *linebuffer;
+    GOutputStream *stream; /* If not NULL, where to write the output */
+    GCancellable *cancellable;
+    GError *error; /* First error writing to the stream */
+    gsize flushed; /* Amount of output already written to the stream */
+    gsize line_start; /* Offset of the last newline in the output */
+    gsize line_checked; /* How much of the output has been searched for it */
+    GHashTable *paragraph_tags; /* Tags applying to the whole current paragraph */
     GHashTable *tag_codes; /* Translation table of GtkTextTags to RTF code */
     GList *font_table;
     GList *color_table;
@@ -48,6 +59,7 @@ writer_context_new(void)
 {
     WriterContext *ctx = g_slice_new0(WriterContext);
     ctx->output = g_string_new("");
+    ctx->paragraph_tags = g_hash_table_new(g_direct_hash, g_direct_equal);
     ctx->tag_codes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
     ctx->font_table = NULL;
     ctx->color_table = g_list_prepend(NULL, g_strdup("")); /* Color 0 always black */
@@ -58,6 +70,10 @@ writer_context_new(void)
 static void
 writer_context_free(WriterContext *ctx)
 {
+    if(ctx->output)
+        g_string_free(ctx->output, TRUE);
+    g_clear_error(&ctx->error);
+    g_hash_table_unref(ctx->paragraph_tags);
     g_hash_table_unref(ctx->tag_codes);
     g_list_foreach(ctx->color_table, (GFunc)g_free, NULL);
     g_list_free(ctx->color_table);
@@ -99,7 +115,7 @@ convert_tag_to_code(GtkTextTag *tag, WriterContext *ctx)
     gint pixels, pango, colornum;
     gdouble factor, points;
     GdkColor *color;
-    const gchar *name;
+    const gchar *name, *script;
     GString *code;
 
     /* First check if this is a osxcart named tag that doesn't have a direct
@@ -120,8 +136,14 @@ convert_tag_to_code(GtkTextTag *tag, WriterContext *ctx)
         }
     }
 
+    /* Merged tags made from a superscript or subscript tag are marked with the
+    code for it, which replaces their rise and scale */
+    script = g_object_get_data(G_OBJECT(tag), "osxcart-rtf-script");
+
     /* Otherwise, read the attributes one by one and add RTF code for them */
     code = g_string_new("");
+    if(script)
+        g_string_append(code, script);
 
     g_object_get(tag, "background-set", &val, NULL);
     if(val)
@@ -248,7 +270,7 @@ convert_tag_to_code(GtkTextTag *tag, WriterContext *ctx)
     }
 
     g_object_get(tag, "rise-set", &val, NULL);
-    if(val)
+    if(val && !script)
     {
         g_object_get(tag, "rise", &pango, NULL);
         if(pango > 0)
@@ -260,7 +282,7 @@ convert_tag_to_code(GtkTextTag *tag, WriterContext *ctx)
     }
 
     g_object_get(tag, "scale-set", &val, NULL);
-    if(val)
+    if(val && !script)
     {
         g_object_get(tag, "scale", &factor, NULL);
         g_string_append_printf(code, "\\charscalex%d", (gint)(factor * 100));
@@ -390,6 +412,40 @@ analyze_buffer(WriterContext *ctx, GtkTextBuffer *textbuffer, const GtkTextIter
     ctx->end = end;
 }
 
+/* Returns the length of the current line of output, counting the newline that
+starts it. Only the output appended since the last call is searched for a
+newline, so each byte of output is looked at once. */
+static gsize
+get_line_length(WriterContext *ctx)
+{
+    gsize pos, total = ctx->flushed + ctx->output->len;
+
+    for(pos = total; pos > ctx->line_checked; pos--)
+        if(ctx->output->str[pos - ctx->flushed - 1] == '\n')
+        {
+            ctx->line_start = pos - 1;
+            break;
+        }
+    ctx->line_checked = total;
+    return total - ctx->line_start;
+}
+
+/* If writing to a stream, write the output collected so far to it once there
+is more than WRITE_BUFFER_SIZE of it, or always if force is TRUE. After an
+error, the output is discarded. */
+static void
+flush_output(WriterContext *ctx, gboolean force)
+{
+    if(!ctx->stream || (!force && ctx->output->len < WRITE_BUFFER_SIZE))
+        return;
+
+    get_line_length(ctx); /* Find the last newline before it is discarded */
+    if(!ctx->error)
+        g_output_stream_write_all(ctx->stream, ctx->output->str, ctx->output->len, NULL, ctx->cancellable, &ctx->error);
+    ctx->flushed += ctx->output->len;
+    g_string_truncate(ctx->output, 0);
+}
+
 /* Write a space to the output buffer if the number of characters output on the
 current line is less than 60; otherwise, a newline. If the next space occurs
 more than 20 characters further on, the line will still be wider than 80
@@ -398,8 +454,7 @@ looking ahead or backtracking to insert spaces. */
 static void
 write_space_or_newline(WriterContext *ctx)
 {
-    int linelength = strlen(strrchr(ctx->output->str, '\n'));
-    g_string_append_c(ctx->output, (linelength > 60)? '\n' : ' ');
+    g_string_append_c(ctx->output, (get_line_length(ctx) > 60)? '\n' : ' ');
 }
 
 /* This function translates a piece of text, without formatting codes, to RTF.
@@ -419,7 +474,7 @@ write_rtf_text(WriterContext *ctx, const gchar *text)
             g_string_append(ctx->output, "\\par");
         else if(ch == ' ')
         {
-            if(strlen(strrchr(ctx->output->str, '\n')) > 60)
+            if(get_line_length(ctx) > 60)
                 g_string_append_c(ctx->output, '\n');
             g_string_append_c(ctx->output, ' ');
             continue;
@@ -502,11 +557,14 @@ write_rtf_text(WriterContext *ctx, const gchar *text)
     }
 }
 
-/* Analyze a segment of text in which there are no tag flips, but possibly embedded pictures */
+/* Analyze a segment of text in which there are no tag flips, but possibly
+embedded pictures. Pictures that were imported lazily and not materialized yet
+are loaded to be written, but stay child anchors in the buffer. */
 static void
 write_rtf_text_and_pictures(WriterContext *ctx, const GtkTextIter *start, const GtkTextIter *end)
 {
     GtkTextIter iter;
+    GtkTextChildAnchor *anchor;
     GdkPixbuf *pixbuf = NULL;
     gchar *text, *pngbuffer;
     gsize bufsize;
@@ -515,19 +573,24 @@ write_rtf_text_and_pictures(WriterContext *ctx, const GtkTextIter *start, const
     for(iter = *start; !gtk_text_iter_equal(&iter, end); gtk_text_iter_forward_char(&iter))
     {
         if((pixbuf = gtk_text_iter_get_pixbuf(&iter)))
+        {
+            g_object_ref(pixbuf);
+            break;
+        }
+        if((anchor = gtk_text_iter_get_child_anchor(&iter)) && (pixbuf = load_lazy_picture(anchor)))
             break;
     }
 
     if(!pixbuf)
     {
-        text = gtk_text_buffer_get_text(ctx->linebuffer, start, end, TRUE);
+        text = gtk_text_buffer_get_text(ctx->textbuffer, start, end, TRUE);
         write_rtf_text(ctx, text);
         g_free(text);
         return;
     }
 
     /* Write the text before the pixbuf, insert a \pict destination into the document, and recurse on the text after */
-    text = gtk_text_buffer_get_text(ctx->linebuffer, start, &iter, TRUE);
+    text = gtk_text_buffer_get_text(ctx->textbuffer, start, &iter, TRUE);
     write_rtf_text(ctx, text);
     g_free(text);
 
@@ -540,26 +603,49 @@ write_rtf_text_and_pictures(WriterContext *ctx, const GtkTextIter *start, const
             if(count % 40 == 0)
                 g_string_append_c(ctx->output, '\n');
             g_string_append_printf(ctx->output, "%02X", (unsigned char)pngbuffer[count]);
+            flush_output(ctx, FALSE);
         }
         g_string_append(ctx->output, "\n}");
         g_free(pngbuffer);
     }
     else
+    {
         g_warning(_("Could not serialize picture, skipping: %s"), error->message);
+        g_error_free(error);
+    }
+    g_object_unref(pixbuf);
 
     gtk_text_iter_forward_char(&iter);
     write_rtf_text_and_pictures(ctx, &iter, end);
 }
 
-/* Copy the text paragraph-by-paragraph into a separate buffer and output each
-one sequentially with formatting codes */
+/* Remove the tags that apply to the whole paragraph from a list of tags,
+because their codes have already been written at the start of the paragraph */
+static GSList *
+remove_paragraph_tags(WriterContext *ctx, GSList *taglist)
+{
+    GSList *ptr = taglist, *next;
+
+    while(ptr)
+    {
+        next = g_slist_next(ptr);
+        if(g_hash_table_lookup(ctx->paragraph_tags, ptr->data))
+            taglist = g_slist_delete_link(taglist, ptr);
+        ptr = next;
+    }
+    return taglist;
+}
+
+/* Output the text paragraph-by-paragraph with formatting codes, walking the
+tag toggles in the text buffer. When writing to a stream, stop at the end of
+a paragraph if there was an error or the operation was cancelled. */
 static void
 write_rtf_paragraphs(WriterContext *ctx)
 {
     GSList *taglist, *ptr;
     GtkTextIter start, end, tagend, linestart = *(ctx->start), lineend = linestart;
 
-    while(gtk_text_iter_in_range(&lineend, ctx->start, ctx->end))
+    while(!ctx->error && gtk_text_iter_in_range(&lineend, ctx->start, ctx->end))
     {
         /* Begin the paragraph by resetting the paragraph properties */
         g_string_append(ctx->output, "{\\pard\\plain");
@@ -572,33 +658,26 @@ write_rtf_paragraphs(WriterContext *ctx)
         if(gtk_text_iter_compare(&lineend, ctx->end) > 0)
             lineend = *(ctx->end);
 
-        /* Copy the entire paragraph to a separate buffer */
-        if(ctx->linebuffer)
-            g_object_unref(ctx->linebuffer);
-        ctx->linebuffer = gtk_text_buffer_new(gtk_text_buffer_get_tag_table(ctx->textbuffer));
-        gtk_text_buffer_get_start_iter(ctx->linebuffer, &start);
-        gtk_text_buffer_insert_range(ctx->linebuffer, &start, &linestart, &lineend);
-        gtk_text_buffer_get_bounds(ctx->linebuffer, &start, &end);
-
-        /* Insert codes for tags that apply to the whole line, then remove those
-        tags because we've dealt with them */
+        /* Insert codes for tags that apply to the whole paragraph, and remember
+        them so that they are skipped in the rest of the paragraph */
+        g_hash_table_remove_all(ctx->paragraph_tags);
         taglist = gtk_text_iter_get_tags(&linestart);
         for(ptr = taglist; ptr; ptr = g_slist_next(ptr))
         {
-            tagend = start;
+            tagend = linestart;
             gtk_text_iter_forward_to_tag_toggle(&tagend, ptr->data);
-            if(gtk_text_iter_equal(&tagend, &end))
+            if(gtk_text_iter_compare(&tagend, &lineend) >= 0)
             {
                 g_string_append(ctx->output, g_hash_table_lookup(ctx->tag_codes, ptr->data));
-                gtk_text_buffer_remove_tag(ctx->linebuffer, ptr->data, &start, &end);
+                g_hash_table_insert(ctx->paragraph_tags, ptr->data, ptr->data);
             }
         }
         g_slist_free(taglist);
         write_space_or_newline(ctx);
         g_string_append_c(ctx->output, '{');
 
-        end = start;
-        while(!gtk_text_iter_is_end(&end))
+        start = end = linestart;
+        while(gtk_text_iter_compare(&end, &lineend) < 0)
         {
             GSList *tagstartlist, *tagendlist, *tagonlylist = NULL;
             gsize length;
@@ -606,11 +685,23 @@ write_rtf_paragraphs(WriterContext *ctx)
             /* Enclose a section of text without any tag flips between start
             and end. Then, make tagstartlist a list of tags that open at the
             beginning of this section, and tagendlist a list of tags that end
-            at the end of this section. */
+            at the end of this section. Tags that were already open before the
+            paragraph count as opening at its beginning, and tags that are
+            still open after the paragraph count as ending at its end. */
 
             gtk_text_iter_forward_to_tag_toggle(&end, NULL);
-            tagstartlist = gtk_text_iter_get_toggled_tags(&start, TRUE);
-            tagendlist = gtk_text_iter_get_toggled_tags(&end, FALSE);
+            if(gtk_text_iter_compare(&end, &lineend) > 0)
+                end = lineend;
+            if(gtk_text_iter_equal(&start, &linestart))
+                tagstartlist = gtk_text_iter_get_tags(&start);
+            else
+                tagstartlist = gtk_text_iter_get_toggled_tags(&start, TRUE);
+            if(gtk_text_iter_equal(&end, &lineend))
+                tagendlist = gtk_text_iter_get_tags(&start);
+            else
+                tagendlist = gtk_text_iter_get_toggled_tags(&end, FALSE);
+            tagstartlist = remove_paragraph_tags(ctx, tagstartlist);
+            tagendlist = remove_paragraph_tags(ctx, tagendlist);
 
             /* Move tags that do not extend before or after this section to
             tagonlylist. */
@@ -653,15 +744,21 @@ write_rtf_paragraphs(WriterContext *ctx)
             /* If any tags end here, close the group and open another one,
             then output the tags that _apply_ to the end iter but do not _start_
             there (those will be output in the next iteration and may need to
-            be in a separate group.) */
+            be in a separate group.) At the end of the paragraph, no tags apply
+            anymore. */
             if(tagendlist)
             {
                 g_string_append(ctx->output, "}{");
-                taglist = gtk_text_iter_get_tags(&end);
-                tagstartlist = gtk_text_iter_get_toggled_tags(&end, TRUE);
-                for(ptr = tagstartlist; ptr; ptr = g_slist_next(ptr))
-                    taglist = g_slist_remove(taglist, ptr->data);
-                g_slist_free(tagstartlist);
+                if(gtk_text_iter_equal(&end, &lineend))
+                    taglist = NULL;
+                else
+                {
+                    taglist = remove_paragraph_tags(ctx, gtk_text_iter_get_tags(&end));
+                    tagstartlist = gtk_text_iter_get_toggled_tags(&end, TRUE);
+                    for(ptr = tagstartlist; ptr; ptr = g_slist_next(ptr))
+                        taglist = g_slist_remove(taglist, ptr->data);
+                    g_slist_free(tagstartlist);
+                }
 
                 length = ctx->output->len;
                 for(ptr = taglist; ptr; ptr = g_slist_next(ptr))
@@ -673,9 +770,13 @@ write_rtf_paragraphs(WriterContext *ctx)
             g_slist_free(tagendlist);
 
             start = end;
+            flush_output(ctx, FALSE);
         }
         g_string_append(ctx->output, "}}\n");
         linestart = lineend;
+
+        if(ctx->stream && !ctx->error)
+            g_cancellable_set_error_if_cancelled(ctx->cancellable, &ctx->error);
     }
 }
 
@@ -686,7 +787,7 @@ write_color_table_entry(const gchar *colorcode, WriterContext *ctx)
 }
 
 /* Write the RTF header and assorted front matter */
-static gchar *
+static void
 write_rtf(WriterContext *ctx)
 {
     GList *iter;
@@ -702,6 +803,7 @@ write_rtf(WriterContext *ctx)
         gchar **fontnames = g_strsplit(iter->data, ",", 2);
         g_string_append_printf(ctx->output, "{\\f%d\\fnil %s;}\n", count, fontnames[0]);
         g_strfreev(fontnames);
+        flush_output(ctx, FALSE);
     }
     if(!ctx->font_table) /* Write at least one font if there are none */
         g_string_append(ctx->output, "{\\f0\\fswiss Sans;}\n");
@@ -711,6 +813,7 @@ write_rtf(WriterContext *ctx)
     g_string_append(ctx->output, "{\\colortbl\n");
     g_list_foreach(ctx->color_table, (GFunc)write_color_table_entry, ctx);
     g_string_append(ctx->output, "}\n");
+    flush_output(ctx, FALSE);
 
     /* Metadata (provide dummy values because Word will overwrite if missing) */
     g_string_append_printf(ctx->output, "{\\*\\generator %s %s}\n", PACKAGE_NAME, PACKAGE_VERSION);
@@ -729,7 +832,7 @@ write_rtf(WriterContext *ctx)
     write_rtf_paragraphs(ctx);
 
     g_string_append_c(ctx->output, '}');
-    return g_string_free(ctx->output, FALSE);
+    flush_output(ctx, TRUE);
 }
 
 /* This function is called by gtk_text_buffer_serialize(). */
@@ -740,8 +843,32 @@ rtf_serialize(GtkTextBuffer *register_buffer, GtkTextBuffer *content_buffer, con
     gchar *contents;
 
     analyze_buffer(ctx, content_buffer, start, end);
-    contents = write_rtf(ctx);
-    *length = strlen(contents);
+    write_rtf(ctx);
+    *length = ctx->output->len;
+    contents = g_string_free(ctx->output, FALSE);
+    ctx->output = NULL;
     writer_context_free(ctx);
     return (guint8 *)contents;
 }
+
+/* Writes RTF code for the text between start and end to stream, in pieces of
+about WRITE_BUFFER_SIZE instead of building it all in memory first. */
+gboolean
+rtf_serialize_to_stream(GtkTextBuffer *buffer, const GtkTextIter *start, const GtkTextIter *end, GOutputStream *stream, GCancellable *cancellable, GError **error)
+{
+    WriterContext *ctx = writer_context_new();
+    gboolean retval = TRUE;
+
+    ctx->stream = stream;
+    ctx->cancellable = cancellable;
+    analyze_buffer(ctx, buffer, start, end);
+    write_rtf(ctx);
+    if(ctx->error)
+    {
+        g_propagate_error(error, ctx->error);
+        ctx->error = NULL;
+        retval = FALSE;
+    }
+    writer_context_free(ctx);
+    return retval;
+}
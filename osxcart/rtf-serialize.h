@@ -17,8 +17,10 @@ You should have received a copy of the GNU Lesser General Public License along
 with Osxcart.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <glib.h>
+#include <gio/gio.h>
 #include <gtk/gtk.h>
 
 G_GNUC_INTERNAL guint8 *rtf_serialize(GtkTextBuffer *register_buffer, GtkTextBuffer *content_buffer, const GtkTextIter *start, const GtkTextIter *end, gsize *length);
+G_GNUC_INTERNAL gboolean rtf_serialize_to_stream(GtkTextBuffer *buffer, const GtkTextIter *start, const GtkTextIter *end, GOutputStream *stream, GCancellable *cancellable, GError **error);
 
 #endif /* __OSXCART_RTF_SERIALIZE_H__ */
\ No newline at end of file
@@ -1,4 +1,4 @@
-/* Copyright 2009, 2012 P. F. Chimento
+/* Copyright 2009, 2012, 2015 P. F. Chimento
 This file is part of Osxcart.
 
 Osxcart is free software: you can redistribute it and/or modify it under the
@@ -52,3 +52,185 @@ set_default_paragraph_attributes(Attributes *attr)
     attr->indent = 0;
     attr->leading = 0;
 }
+
+/* Returns whether text with attributes 'attr1' looks the same as text with
+attributes 'attr2' */
+gboolean
+attributes_equal(const Attributes *attr1, const Attributes *attr2)
+{
+    return attr1->style == attr2->style
+        && attr1->justification == attr2->justification
+        && attr1->pardirection == attr2->pardirection
+        && attr1->space_before == attr2->space_before
+        && attr1->space_after == attr2->space_after
+        && attr1->ignore_space_before == attr2->ignore_space_before
+        && attr1->ignore_space_after == attr2->ignore_space_after
+        && tab_stops_equal(attr1->tabs, attr2->tabs)
+        && attr1->left_margin == attr2->left_margin
+        && attr1->right_margin == attr2->right_margin
+        && attr1->indent == attr2->indent
+        && attr1->leading == attr2->leading
+        && attr1->foreground == attr2->foreground
+        && attr1->background == attr2->background
+        && attr1->highlight == attr2->highlight
+        && attr1->font == attr2->font
+        && attr1->size == attr2->size
+        && attr1->italic == attr2->italic
+        && attr1->bold == attr2->bold
+        && attr1->smallcaps == attr2->smallcaps
+        && attr1->strikethrough == attr2->strikethrough
+        && attr1->subscript == attr2->subscript
+        && attr1->superscript == attr2->superscript
+        && attr1->invisible == attr2->invisible
+        && attr1->underline == attr2->underline
+        && attr1->chardirection == attr2->chardirection
+        && attr1->language == attr2->language
+        && attr1->rise == attr2->rise
+        && attr1->scale == attr2->scale;
+}
+
+/* Hash function for attributes, consistent with attributes_equal() */
+guint
+attributes_hash(const Attributes *attr)
+{
+    guint hash = attr->style;
+
+    hash = hash * 31 + attr->justification;
+    hash = hash * 31 + attr->pardirection;
+    hash = hash * 31 + attr->space_before;
+    hash = hash * 31 + attr->space_after;
+    hash = hash * 31 + tab_stops_hash(attr->tabs);
+    hash = hash * 31 + attr->left_margin;
+    hash = hash * 31 + attr->right_margin;
+    hash = hash * 31 + attr->indent;
+    hash = hash * 31 + attr->leading;
+    hash = hash * 31 + attr->foreground;
+    hash = hash * 31 + attr->background;
+    hash = hash * 31 + attr->highlight;
+    hash = hash * 31 + attr->font;
+    hash = hash * 31 + (guint)(attr->size * 1000.0);
+    hash = hash * 31 + attr->underline;
+    hash = hash * 31 + attr->chardirection;
+    hash = hash * 31 + attr->language;
+    hash = hash * 31 + attr->rise;
+    hash = hash * 31 + attr->scale;
+    /* Flags */
+    hash = hash * 31 + ((attr->ignore_space_before? 1 : 0)
+        | (attr->ignore_space_after? 2 : 0)
+        | (attr->italic? 4 : 0)
+        | (attr->bold? 8 : 0)
+        | (attr->smallcaps? 16 : 0)
+        | (attr->strikethrough? 32 : 0)
+        | (attr->subscript? 64 : 0)
+        | (attr->superscript? 128 : 0)
+        | (attr->invisible? 256 : 0));
+    return hash;
+}
+
+/* Allocate a copy of 'attr', sharing its tab stops */
+Attributes *
+attributes_copy(const Attributes *attr)
+{
+    Attributes *copy = g_slice_dup(Attributes, attr);
+    if(copy->tabs)
+        tab_stops_ref(copy->tabs);
+    return copy;
+}
+
+/* Free a copy of attributes made by attributes_copy() */
+void
+attributes_free(Attributes *attr)
+{
+    if(attr->tabs)
+        tab_stops_unref(attr->tabs);
+    g_slice_free(Attributes, attr);
+}
+
+/* Create a set of tab stops with one unset tab stop in it */
+TabStops *
+tab_stops_new(void)
+{
+    TabStops *tabs = g_slice_new(TabStops);
+    tabs->array = pango_tab_array_new(1, FALSE);
+    tabs->refcount = 1;
+    return tabs;
+}
+
+TabStops *
+tab_stops_ref(TabStops *tabs)
+{
+    tabs->refcount++;
+    return tabs;
+}
+
+void
+tab_stops_unref(TabStops *tabs)
+{
+    if(--tabs->refcount > 0)
+        return;
+    pango_tab_array_free(tabs->array);
+    g_slice_free(TabStops, tabs);
+}
+
+/* Returns whether two sets of tab stops, either of which may be NULL, are at
+the same positions */
+gboolean
+tab_stops_equal(const TabStops *tabs1, const TabStops *tabs2)
+{
+    gint size, count;
+
+    if(tabs1 == tabs2)
+        return TRUE;
+    if(tabs1 == NULL || tabs2 == NULL)
+        return FALSE;
+    size = pango_tab_array_get_size(tabs1->array);
+    if(size != pango_tab_array_get_size(tabs2->array))
+        return FALSE;
+    for(count = 0; count < size; count++)
+    {
+        PangoTabAlign align1, align2;
+        gint location1, location2;
+        pango_tab_array_get_tab(tabs1->array, count, &align1, &location1);
+        pango_tab_array_get_tab(tabs2->array, count, &align2, &location2);
+        if(align1 != align2 || location1 != location2)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Hash function for tab stops, which may be NULL, consistent with
+tab_stops_equal() */
+guint
+tab_stops_hash(const TabStops *tabs)
+{
+    gint size, count;
+    guint hash = 0;
+
+    if(tabs == NULL)
+        return 0;
+    size = pango_tab_array_get_size(tabs->array);
+    for(count = 0; count < size; count++)
+    {
+        gint location;
+        pango_tab_array_get_tab(tabs->array, count, NULL, &location);
+        hash = hash * 31 + location;
+    }
+    return hash * 31 + size;
+}
+
+/* Return tab stops that may be modified without affecting anyone else: either
+'tabs' itself, or a copy of it if it is shared, in which case the reference to
+'tabs' is given up */
+TabStops *
+tab_stops_make_writable(TabStops *tabs)
+{
+    TabStops *copy;
+
+    if(tabs->refcount == 1)
+        return tabs;
+    copy = g_slice_new(TabStops);
+    copy->array = pango_tab_array_copy(tabs->array);
+    copy->refcount = 1;
+    tab_stops_unref(tabs);
+    return copy;
+}
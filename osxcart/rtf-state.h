@@ -20,10 +20,21 @@ with Osxcart.  If not, see <http://www.gnu.org/licenses/>. */
 #include <gtk/gtk.h>
 #include <pango/pango.h>
 
-typedef gpointer StateNewFunc(void);
-typedef gpointer StateCopyFunc(gconstpointer);
+/* State functions work in place on memory owned by the parser's state stacks.
+StateNewFunc initializes zeroed memory, StateCopyFunc copies its first argument
+into its second, and StateFreeFunc frees anything the state owns, but not the
+state itself. */
+typedef void StateNewFunc(gpointer);
+typedef void StateCopyFunc(gconstpointer, gpointer);
 typedef void StateFreeFunc(gpointer);
 
+/* Tab stops, shared by reference between a group and the groups nested in it
+until one of them adds a tab stop */
+typedef struct {
+    PangoTabArray *array;
+    gint refcount;
+} TabStops;
+
 typedef struct {
     gint style; /* Index into style sheet */
 
@@ -35,7 +46,7 @@ typedef struct {
     gint space_after;
     gboolean ignore_space_before;
     gboolean ignore_space_after;
-    PangoTabArray *tabs;
+    TabStops *tabs;
     gint left_margin;
     gint right_margin;
     gint indent;
@@ -69,6 +80,16 @@ typedef struct {
 
 G_GNUC_INTERNAL void set_default_character_attributes(Attributes *attr);
 G_GNUC_INTERNAL void set_default_paragraph_attributes(Attributes *attr);
+G_GNUC_INTERNAL gboolean attributes_equal(const Attributes *attr1, const Attributes *attr2);
+G_GNUC_INTERNAL guint attributes_hash(const Attributes *attr);
+G_GNUC_INTERNAL Attributes *attributes_copy(const Attributes *attr);
+G_GNUC_INTERNAL void attributes_free(Attributes *attr);
+G_GNUC_INTERNAL TabStops *tab_stops_new(void);
+G_GNUC_INTERNAL TabStops *tab_stops_ref(TabStops *tabs);
+G_GNUC_INTERNAL void tab_stops_unref(TabStops *tabs);
+G_GNUC_INTERNAL TabStops *tab_stops_make_writable(TabStops *tabs);
+G_GNUC_INTERNAL gboolean tab_stops_equal(const TabStops *tabs1, const TabStops *tabs2);
+G_GNUC_INTERNAL guint tab_stops_hash(const TabStops *tabs);
 
 #ifndef G_PASTE_ARGS /* available since 2.20 */
 #define G_PASTE_ARGS(identifier1,identifier2) identifier1 ## identifier2
@@ -81,33 +102,31 @@ G_GNUC_INTERNAL void set_default_paragraph_attributes(Attributes *attr);
     ((Attributes *)state)->unicode_ignore = FALSE;
 #define ATTR_COPY \
     if(((Attributes *)state)->tabs) \
-        ((Attributes *)copy)->tabs = pango_tab_array_copy(((Attributes *)state)->tabs);
+        ((Attributes *)copy)->tabs = tab_stops_ref(((Attributes *)state)->tabs);
 #define ATTR_FREE \
     if(((Attributes *)state)->tabs) \
-        pango_tab_array_free(((Attributes *)state)->tabs);
+        tab_stops_unref(((Attributes *)state)->tabs);
 
 #define DEFINE_STATE_FUNCTIONS_FULL(tn, fn, init_code, copy_code, free_code) \
-    static gpointer \
-    G_PASTE_ARGS(fn, _state_new)(void) \
+    static void \
+    G_PASTE_ARGS(fn, _state_new)(gpointer st) \
     { \
-        tn *state = g_slice_new0(tn); \
+        tn *state G_GNUC_UNUSED = (tn *)st; \
         init_code \
-        return state; \
     } \
-    static gpointer \
-    G_PASTE_ARGS(fn, _state_copy)(gconstpointer st) \
+    static void \
+    G_PASTE_ARGS(fn, _state_copy)(gconstpointer st, gpointer cp) \
     { \
         const tn *state = (const tn *)st; \
-        tn *copy = g_slice_dup(tn, state); \
+        tn *copy = (tn *)cp; \
+        *copy = *state; \
         copy_code \
-        return copy; \
     } \
     static void \
     G_PASTE_ARGS(fn, _state_free)(gpointer st) \
     { \
-        tn *state = (tn *)st; \
+        tn *state G_GNUC_UNUSED = (tn *)st; \
         free_code \
-        g_slice_free(tn, state); \
     }
 
 #define DEFINE_SIMPLE_STATE_FUNCTIONS(tn, fn) \
@@ -55,44 +55,38 @@ DEFINE_STYLE_FUNCTION(sty_ts, STYLE_TABLE)
 
 const ControlWord stylesheet_word_table[] = {
     FORMATTED_TEXT_CONTROL_WORDS,
-    { "*cs", REQUIRED_PARAMETER, TRUE, sty_cs },
-    { "*ds", REQUIRED_PARAMETER, TRUE, sty_ds },
-    { "s", OPTIONAL_PARAMETER, TRUE, sty_s, 0 },
-    { "*ts", REQUIRED_PARAMETER, TRUE, sty_ts },
+    { "*cs", REQUIRED_PARAMETER, FLUSH_BUFFER, sty_cs },
+    { "*ds", REQUIRED_PARAMETER, FLUSH_BUFFER, sty_ds },
+    { "s", OPTIONAL_PARAMETER, FLUSH_BUFFER, sty_s, 0 },
+    { "*ts", REQUIRED_PARAMETER, FLUSH_BUFFER, sty_ts },
     { NULL }
 };
 
 DEFINE_ATTR_STATE_FUNCTIONS(StylesheetState, stylesheet)
 
+static gsize stylesheet_word_index = 0;
+
 const DestinationInfo stylesheet_destination = {
     stylesheet_word_table,
+    &stylesheet_word_index,
     stylesheet_text,
+    sizeof(StylesheetState),
     stylesheet_state_new,
     stylesheet_state_copy,
     stylesheet_state_free
 };
 
-/* Add a style tag to the GtkTextBuffer's tag table with all the attributes of
-the current style */
+/* Add a tag for style number 'index' to the GtkTextBuffer's tag table, with all
+the attributes 'attr' of the style */
 static void
-stylesheet_text(ParserContext *ctx)
+add_style_tag(ParserContext *ctx, gint index, const Attributes *attr)
 {
-    gchar *semicolon, *tagname;
-    StylesheetState *state = get_state(ctx);
-    Attributes *attr = (Attributes *)state;
+    gchar *tagname = g_strdup_printf("osxcart-rtf-style-%i", index);
     GtkTextTag *tag;
 
-    semicolon = strchr(ctx->text->str, ';');
-    if(!semicolon)
-    {
-        g_string_truncate(ctx->text, 0);
-        return;
-    }
-    g_string_assign(ctx->text, semicolon + 1); /* Leave the text after the semicolon in the buffer */
-
-    tagname = g_strdup_printf("osxcart-rtf-style-%i", state->index);
     if((tag = gtk_text_tag_table_lookup(ctx->tags, tagname)))
         gtk_text_tag_table_remove(ctx->tags, tag);
+    uncache_tag(ctx, TAG_STYLE, index);
     tag = gtk_text_tag_new(tagname);
 
     /* Add each paragraph attribute to the tag */
@@ -115,7 +109,7 @@ stylesheet_text(ParserContext *ctx)
                      NULL);
     if(attr->tabs)
         g_object_set(tag,
-                     "tabs", attr->tabs,
+                     "tabs", attr->tabs->array,
                      "tabs-set", TRUE,
                      NULL);
     if(attr->left_margin)
@@ -142,7 +136,7 @@ stylesheet_text(ParserContext *ctx)
     /* Add each character attribute to the tag */
     if(attr->foreground != -1)
     {
-        gchar *color = g_slist_nth_data(ctx->color_table, attr->foreground);
+        const gchar *color = get_color(ctx, attr->foreground);
         /* color must exist, because that was already checked when executing
          the \cf command */
         g_object_set(tag,
@@ -152,7 +146,7 @@ stylesheet_text(ParserContext *ctx)
     }
     if(attr->background != -1)
     {
-        gchar *color = g_slist_nth_data(ctx->color_table, attr->background);
+        const gchar *color = get_color(ctx, attr->background);
         /* color must exist, because that was already checked when executing
          the \cf command */
         g_object_set(tag,
@@ -162,7 +156,7 @@ stylesheet_text(ParserContext *ctx)
     }
     if(attr->highlight != -1)
     {
-        gchar *color = g_slist_nth_data(ctx->color_table, attr->highlight);
+        const gchar *color = get_color(ctx, attr->highlight);
         /* color must exist, because that was already checked when executing
          the \cf command */
         g_object_set(tag,
@@ -245,6 +239,30 @@ stylesheet_text(ParserContext *ctx)
 
     gtk_text_tag_table_add(ctx->tags, tag);
     g_free(tagname);
+}
+
+/* Add the current style to the document: as a style tag, or if the parser was
+asked to merge tags, as a copy of its attributes that the merged tags of text in
+this style get their properties from */
+static void
+stylesheet_text(ParserContext *ctx)
+{
+    gchar *semicolon;
+    StylesheetState *state = get_state(ctx);
+    Attributes *attr = (Attributes *)state;
+
+    semicolon = strchr(ctx->text->str, ';');
+    if(!semicolon)
+    {
+        g_string_truncate(ctx->text, 0);
+        return;
+    }
+    g_string_assign(ctx->text, semicolon + 1); /* Leave the text after the semicolon in the buffer */
+
+    if(ctx->options.merge_tags)
+        g_hash_table_replace(ctx->style_attributes, GINT_TO_POINTER(state->index), attributes_copy(attr));
+    else
+        add_style_tag(ctx, state->index, attr);
 
     state->index = 0;
     state->type = STYLE_PARAGRAPH;
@@ -80,6 +80,236 @@ rtf_register_serialize_format(GtkTextBuffer *buffer)
     return gtk_text_buffer_register_serialize_format(buffer, "text/rtf", (GtkTextBufferSerializeFunc)rtf_serialize, NULL, NULL);
 }
 
+#if GLIB_CHECK_VERSION(2,26,0)
+G_DEFINE_BOXED_TYPE(RtfImportOptions, rtf_import_options, rtf_import_options_copy, rtf_import_options_free)
+#else
+/* G_DEFINE_BOXED_TYPE() is not available before GLib 2.26 */
+GType
+rtf_import_options_get_type(void)
+{
+    static volatile gsize type_id = 0;
+
+    if(g_once_init_enter(&type_id))
+    {
+        GType type = g_boxed_type_register_static(g_intern_static_string("RtfImportOptions"), (GBoxedCopyFunc)rtf_import_options_copy, (GBoxedFreeFunc)rtf_import_options_free);
+        g_once_init_leave(&type_id, type);
+    }
+    return type_id;
+}
+#endif
+
+/**
+ * rtf_import_options_new:
+ *
+ * Creates a set of RTF import options with everything set to the default
+ * values, which import the document the same way as the functions that don't
+ * take options.
+ *
+ * Returns: (transfer full): a newly-allocated #RtfImportOptions, to be freed
+ * with rtf_import_options_free().
+ *
+ * Since: 1.3
+ */
+RtfImportOptions *
+rtf_import_options_new(void)
+{
+    osxcart_init();
+    return g_slice_new0(RtfImportOptions);
+}
+
+/**
+ * rtf_import_options_copy: (skip)
+ * @options: the #RtfImportOptions to copy
+ *
+ * Makes a copy of @options.
+ *
+ * Returns: (transfer full): a newly-allocated #RtfImportOptions.
+ *
+ * Since: 1.3
+ */
+RtfImportOptions *
+rtf_import_options_copy(RtfImportOptions *options)
+{
+    g_return_val_if_fail(options != NULL, NULL);
+    return g_slice_dup(RtfImportOptions, options);
+}
+
+/**
+ * rtf_import_options_free: (skip)
+ * @options: the #RtfImportOptions to free
+ *
+ * Deallocates @options.
+ *
+ * Since: 1.3
+ */
+void
+rtf_import_options_free(RtfImportOptions *options)
+{
+    g_return_if_fail(options != NULL);
+    g_slice_free(RtfImportOptions, options);
+}
+
+/**
+ * rtf_import_options_set_merge_tags:
+ * @options: a set of RTF import options
+ * @merge_tags: whether to merge the formatting of each run of text into one tag
+ *
+ * Normally, imported text gets a separate tag for each formatting attribute it
+ * has: one for bold, one for the font, one for the font size, and so on. If
+ * @merge_tags is %TRUE, then each distinct combination of formatting
+ * attributes in the document gets one anonymous tag with all the properties of
+ * those separate tags instead, and only that tag is applied to the text. The
+ * separate tags, including the tags for the fonts and styles in the document,
+ * are not added to the text buffer's tag table at all. This keeps the number of
+ * tags in the text buffer low, which makes importing and displaying long
+ * documents faster, but the tags can't be looked up by name.
+ *
+ * Since: 1.3
+ */
+void
+rtf_import_options_set_merge_tags(RtfImportOptions *options, gboolean merge_tags)
+{
+    g_return_if_fail(options != NULL);
+    options->merge_tags = merge_tags;
+}
+
+/**
+ * rtf_import_options_get_merge_tags:
+ * @options: a set of RTF import options
+ *
+ * See rtf_import_options_set_merge_tags().
+ *
+ * Returns: whether @options merges the formatting of each run of text into one
+ * tag.
+ *
+ * Since: 1.3
+ */
+gboolean
+rtf_import_options_get_merge_tags(RtfImportOptions *options)
+{
+    g_return_val_if_fail(options != NULL, FALSE);
+    return options->merge_tags;
+}
+
+/**
+ * rtf_import_options_set_lazy_pictures:
+ * @options: a set of RTF import options
+ * @lazy_pictures: whether to put off loading the pictures in the document
+ *
+ * Normally, all the pictures in an imported document are loaded during the
+ * import. If @lazy_pictures is %TRUE, then each picture is imported as a
+ * #GtkTextChildAnchor that holds the picture's data, format, and size, without
+ * loading it; this makes importing documents with many large pictures much
+ * faster if not all of them are needed. Call
+ * rtf_text_buffer_materialize_pictures() to replace the child anchors by the
+ * pictures when they are needed. Exporting the buffer loads the pictures that
+ * are still child anchors in order to write them, but leaves the anchors in
+ * place.
+ *
+ * Since: 1.3
+ */
+void
+rtf_import_options_set_lazy_pictures(RtfImportOptions *options, gboolean lazy_pictures)
+{
+    g_return_if_fail(options != NULL);
+    options->lazy_pictures = lazy_pictures;
+}
+
+/**
+ * rtf_import_options_get_lazy_pictures:
+ * @options: a set of RTF import options
+ *
+ * See rtf_import_options_set_lazy_pictures().
+ *
+ * Returns: whether @options puts off loading the pictures in the document.
+ *
+ * Since: 1.3
+ */
+gboolean
+rtf_import_options_get_lazy_pictures(RtfImportOptions *options)
+{
+    g_return_val_if_fail(options != NULL, FALSE);
+    return options->lazy_pictures;
+}
+
+/**
+ * rtf_import_options_set_max_picture_pixels:
+ * @options: a set of RTF import options
+ * @max_pixels: the maximum number of pixels in one picture, or 0 for no limit
+ *
+ * Limits the size of each picture in an imported document to @max_pixels
+ * pixels. Larger pictures are loaded at a smaller size, keeping their aspect
+ * ratio, so that loading a document with huge pictures doesn't use up all
+ * available memory. Each pixel takes up to 4 bytes.
+ *
+ * Since: 1.3
+ */
+void
+rtf_import_options_set_max_picture_pixels(RtfImportOptions *options, guint64 max_pixels)
+{
+    g_return_if_fail(options != NULL);
+    options->max_picture_pixels = max_pixels;
+}
+
+/**
+ * rtf_import_options_get_max_picture_pixels:
+ * @options: a set of RTF import options
+ *
+ * See rtf_import_options_set_max_picture_pixels().
+ *
+ * Returns: the maximum number of pixels in one picture, or 0 for no limit.
+ *
+ * Since: 1.3
+ */
+guint64
+rtf_import_options_get_max_picture_pixels(RtfImportOptions *options)
+{
+    g_return_val_if_fail(options != NULL, 0);
+    return options->max_picture_pixels;
+}
+
+/**
+ * rtf_import_options_set_max_document_pixels:
+ * @options: a set of RTF import options
+ * @max_pixels: the maximum number of pixels in all the pictures in a document,
+ * or 0 for no limit
+ *
+ * Limits the total size of the pictures in an imported document to
+ * @max_pixels pixels. Each picture gets what is left over by the pictures
+ * before it, and is loaded at a smaller size if it doesn't fit. Once there is
+ * nothing left over, the rest of the pictures are not loaded.
+ *
+ * With lazy pictures (see rtf_import_options_set_lazy_pictures()), the pictures
+ * share out the pixels when they are imported, even though they are only
+ * loaded later.
+ *
+ * Since: 1.3
+ */
+void
+rtf_import_options_set_max_document_pixels(RtfImportOptions *options, guint64 max_pixels)
+{
+    g_return_if_fail(options != NULL);
+    options->max_document_pixels = max_pixels;
+}
+
+/**
+ * rtf_import_options_get_max_document_pixels:
+ * @options: a set of RTF import options
+ *
+ * See rtf_import_options_set_max_document_pixels().
+ *
+ * Returns: the maximum number of pixels in all the pictures in a document, or
+ * 0 for no limit.
+ *
+ * Since: 1.3
+ */
+guint64
+rtf_import_options_get_max_document_pixels(RtfImportOptions *options)
+{
+    g_return_val_if_fail(options != NULL, 0);
+    return options->max_document_pixels;
+}
+
 /**
  * rtf_register_deserialize_format:
  * @buffer: a text buffer
@@ -94,6 +324,32 @@ rtf_register_serialize_format(GtkTextBuffer *buffer)
  */
 GdkAtom
 rtf_register_deserialize_format(GtkTextBuffer *buffer)
+{
+    osxcart_init();
+
+    g_return_val_if_fail(buffer != NULL, GDK_NONE);
+    g_return_val_if_fail(GTK_IS_TEXT_BUFFER(buffer), GDK_NONE);
+
+    return rtf_register_deserialize_format_with_options(buffer, NULL);
+}
+
+/**
+ * rtf_register_deserialize_format_with_options:
+ * @buffer: a text buffer
+ * @options: (allow-none): a set of RTF import options, or %NULL
+ *
+ * Like rtf_register_deserialize_format(), but the format imports RTF according
+ * to @options. The options are copied, so @options may be freed or changed
+ * afterwards without affecting the registered format.
+ *
+ * Returns: (transfer none): a <link linkend="GdkAtom">GdkAtom</link>
+ * representing the deserialization format, to be passed to
+ * gtk_text_buffer_deserialize().
+ *
+ * Since: 1.3
+ */
+GdkAtom
+rtf_register_deserialize_format_with_options(GtkTextBuffer *buffer, RtfImportOptions *options)
 {
     GdkAtom format;
 
@@ -102,11 +358,34 @@ rtf_register_deserialize_format(GtkTextBuffer *buffer)
     g_return_val_if_fail(buffer != NULL, GDK_NONE);
     g_return_val_if_fail(GTK_IS_TEXT_BUFFER(buffer), GDK_NONE);
 
-    format = gtk_text_buffer_register_deserialize_format(buffer, "text/rtf", (GtkTextBufferDeserializeFunc)rtf_deserialize, NULL, NULL);
+    if(options)
+        format = gtk_text_buffer_register_deserialize_format(buffer, "text/rtf", (GtkTextBufferDeserializeFunc)rtf_deserialize, rtf_import_options_copy(options), (GDestroyNotify)rtf_import_options_free);
+    else
+        format = gtk_text_buffer_register_deserialize_format(buffer, "text/rtf", (GtkTextBufferDeserializeFunc)rtf_deserialize, NULL, NULL);
     gtk_text_buffer_deserialize_set_can_create_tags(buffer, format, TRUE);
     return format;
 }
 
+/* Replaces the contents of 'buffer' with the RTF document in 'data'; the data
+may contain nul bytes inside \binN control words, so it is passed with its
+length */
+static gboolean
+import_rtf_data(GtkTextBuffer *buffer, const gchar *data, gsize length, RtfImportOptions *options, GError **error)
+{
+    GdkAtom format;
+    GtkTextIter start;
+    gboolean retval;
+
+    gtk_text_buffer_set_text(buffer, "", -1);
+    gtk_text_buffer_get_start_iter(buffer, &start);
+
+    format = rtf_register_deserialize_format_with_options(buffer, options);
+    retval = gtk_text_buffer_deserialize(buffer, buffer, format, &start, (guint8 *)data, length, error);
+    gtk_text_buffer_unregister_deserialize_format(buffer, format);
+
+    return retval;
+}
+
 /**
  * rtf_text_buffer_import_file:
  * @buffer: the text buffer into which to import text
@@ -139,8 +418,41 @@ rtf_register_deserialize_format(GtkTextBuffer *buffer)
  */
 gboolean
 rtf_text_buffer_import_file(GtkTextBuffer *buffer, GFile *file, GCancellable *cancellable, GError **error)
+{
+    osxcart_init();
+
+    g_return_val_if_fail(buffer != NULL, FALSE);
+    g_return_val_if_fail(GTK_IS_TEXT_BUFFER(buffer), FALSE);
+    g_return_val_if_fail(file != NULL, FALSE);
+    g_return_val_if_fail(G_IS_FILE(file), FALSE);
+    g_return_val_if_fail(cancellable == NULL || G_IS_CANCELLABLE(cancellable), FALSE);
+    g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+    return rtf_text_buffer_import_file_with_options(buffer, file, NULL, cancellable, error);
+}
+
+/**
+ * rtf_text_buffer_import_file_with_options:
+ * @buffer: the text buffer into which to import text
+ * @file: a #GFile pointing to an RTF text file
+ * @options: (allow-none): a set of RTF import options, or %NULL
+ * @cancellable: (allow-none): optional #GCancellable object, or %NULL
+ * @error: return location for an error, or %NULL
+ *
+ * Like rtf_text_buffer_import_file(), but imports the RTF according to
+ * @options. Passing %NULL for @options is the same as calling
+ * rtf_text_buffer_import_file().
+ *
+ * Returns: %TRUE if the operation was successful, %FALSE if not, in which case
+ * @error is set.
+ *
+ * Since: 1.3
+ */
+gboolean
+rtf_text_buffer_import_file_with_options(GtkTextBuffer *buffer, GFile *file, RtfImportOptions *options, GCancellable *cancellable, GError **error)
 {
     char *cwd, *contents, *tmpstr, *basename, *newdir;
+    gsize length;
     GFile *check_file, *real_file, *parent;
     gboolean retval;
 
@@ -190,7 +502,7 @@ rtf_text_buffer_import_file(GtkTextBuffer *buffer, GFile *file, GCancellable *ca
     }
     g_free(newdir);
 
-    if(!g_file_load_contents(real_file, cancellable, &contents, NULL, NULL, error))
+    if(!g_file_load_contents(real_file, cancellable, &contents, &length, NULL, error))
     {
         g_object_unref(real_file);
         if(g_chdir(cwd) == -1)
@@ -199,7 +511,7 @@ rtf_text_buffer_import_file(GtkTextBuffer *buffer, GFile *file, GCancellable *ca
         return FALSE;
     }
     g_object_unref(real_file);
-    retval = rtf_text_buffer_import_from_string(buffer, contents, error);
+    retval = import_rtf_data(buffer, contents, length, options, error);
     g_free(contents);
 
     /* Change the directory back */
@@ -266,10 +578,35 @@ rtf_text_buffer_import(GtkTextBuffer *buffer, const char *filename, GError **err
 gboolean
 rtf_text_buffer_import_from_string(GtkTextBuffer *buffer, const gchar *string, GError **error)
 {
-    GdkAtom format;
-    GtkTextIter start;
-    gboolean retval;
+    osxcart_init();
 
+    g_return_val_if_fail(buffer != NULL, FALSE);
+    g_return_val_if_fail(GTK_IS_TEXT_BUFFER(buffer), FALSE);
+    g_return_val_if_fail(string != NULL, FALSE);
+    g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+    return rtf_text_buffer_import_from_string_with_options(buffer, string, NULL, error);
+}
+
+/**
+ * rtf_text_buffer_import_from_string_with_options:
+ * @buffer: the text buffer into which to import text
+ * @string: a string containing an RTF document
+ * @options: (allow-none): a set of RTF import options, or %NULL
+ * @error: return location for an error, or %NULL
+ *
+ * Like rtf_text_buffer_import_from_string(), but imports the RTF according to
+ * @options. Passing %NULL for @options is the same as calling
+ * rtf_text_buffer_import_from_string().
+ *
+ * Returns: %TRUE if the operation was successful, %FALSE if not, in which case
+ * @error is set.
+ *
+ * Since: 1.3
+ */
+gboolean
+rtf_text_buffer_import_from_string_with_options(GtkTextBuffer *buffer, const gchar *string, RtfImportOptions *options, GError **error)
+{
     osxcart_init();
 
     g_return_val_if_fail(buffer != NULL, FALSE);
@@ -277,14 +614,46 @@ rtf_text_buffer_import_from_string(GtkTextBuffer *buffer, const gchar *string, G
     g_return_val_if_fail(string != NULL, FALSE);
     g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-    gtk_text_buffer_set_text(buffer, "", -1);
-    gtk_text_buffer_get_start_iter(buffer, &start);
+    return import_rtf_data(buffer, string, strlen(string), options, error);
+}
 
-    format = rtf_register_deserialize_format(buffer);
-    retval = gtk_text_buffer_deserialize(buffer, buffer, format, &start, (guint8 *)string, strlen(string), error);
-    gtk_text_buffer_unregister_deserialize_format(buffer, format);
+/**
+ * rtf_text_buffer_materialize_pictures:
+ * @buffer: a text buffer into which RTF was imported with lazy pictures
+ * @start: (allow-none): start of the range in which to load pictures, or %NULL
+ * for the start of @buffer
+ * @end: (allow-none): end of the range in which to load pictures, or %NULL for
+ * the end of @buffer
+ *
+ * Loads the pictures between @start and @end that were imported with the
+ * lazy pictures option (see rtf_import_options_set_lazy_pictures()), and
+ * replaces their child anchors by the pictures. Pictures that can't be loaded
+ * are removed. Other child anchors are left alone.
+ *
+ * @start and @end are invalidated if any pictures are loaded.
+ *
+ * Since: 1.3
+ */
+void
+rtf_text_buffer_materialize_pictures(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end)
+{
+    GtkTextIter real_start, real_end;
 
-    return retval;
+    osxcart_init();
+
+    g_return_if_fail(buffer != NULL);
+    g_return_if_fail(GTK_IS_TEXT_BUFFER(buffer));
+
+    if(start)
+        real_start = *start;
+    else
+        gtk_text_buffer_get_start_iter(buffer, &real_start);
+    if(end)
+        real_end = *end;
+    else
+        gtk_text_buffer_get_end_iter(buffer, &real_end);
+
+    materialize_pictures(buffer, &real_start, &real_end);
 }
 
 /**
@@ -316,7 +685,8 @@ rtf_text_buffer_import_from_string(GtkTextBuffer *buffer, const gchar *string, G
 gboolean
 rtf_text_buffer_export_file(GtkTextBuffer *buffer, GFile *file, GCancellable *cancellable, GError **error)
 {
-    char *string;
+    GFileOutputStream *stream;
+    GCancellable *abort;
     gboolean retval;
 
     osxcart_init();
@@ -328,12 +698,66 @@ rtf_text_buffer_export_file(GtkTextBuffer *buffer, GFile *file, GCancellable *ca
     g_return_val_if_fail(cancellable == NULL || G_IS_CANCELLABLE(cancellable), FALSE);
     g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-    string = rtf_text_buffer_export_to_string(buffer);
-    retval = g_file_replace_contents(file, string, strlen(string), NULL, FALSE, G_FILE_CREATE_NONE, NULL, cancellable, error);
-    g_free(string);
+    stream = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_NONE, cancellable, error);
+    if(!stream)
+        return FALSE;
+
+    if(!rtf_text_buffer_export_to_stream(buffer, G_OUTPUT_STREAM(stream), cancellable, error))
+    {
+        /* Closing the stream with a cancelled cancellable leaves the original
+        file in place */
+        abort = g_cancellable_new();
+        g_cancellable_cancel(abort);
+        g_output_stream_close(G_OUTPUT_STREAM(stream), abort, NULL);
+        g_object_unref(abort);
+        g_object_unref(stream);
+        return FALSE;
+    }
+
+    retval = g_output_stream_close(G_OUTPUT_STREAM(stream), cancellable, error);
+    g_object_unref(stream);
     return retval;
 }
 
+/**
+ * rtf_text_buffer_export_to_stream:
+ * @buffer: the text buffer to export
+ * @stream: a #GOutputStream to write to
+ * @cancellable: (allow-none): optional #GCancellable object, or %NULL
+ * @error: return location for an error, or %NULL
+ *
+ * Serializes the contents of @buffer to @stream in RTF format. See
+ * rtf_text_buffer_export_file() for details. The RTF code is written to
+ * @stream in small pieces as it is generated, so the whole document is never
+ * held in memory at once. @stream is not closed.
+ *
+ * The operation can be cancelled by triggering @cancellable from another
+ * thread; this is checked after each paragraph. If the operation is cancelled
+ * or fails, part of the document may already have been written to @stream.
+ *
+ * Returns: %TRUE if the operation succeeded, %FALSE if not, in which case
+ * @error is set.
+ *
+ * Since: 1.3
+ */
+gboolean
+rtf_text_buffer_export_to_stream(GtkTextBuffer *buffer, GOutputStream *stream, GCancellable *cancellable, GError **error)
+{
+    GtkTextIter start, end;
+
+    osxcart_init();
+
+    g_return_val_if_fail(buffer != NULL, FALSE);
+    g_return_val_if_fail(GTK_IS_TEXT_BUFFER(buffer), FALSE);
+    g_return_val_if_fail(stream != NULL, FALSE);
+    g_return_val_if_fail(G_IS_OUTPUT_STREAM(stream), FALSE);
+    g_return_val_if_fail(cancellable == NULL || G_IS_CANCELLABLE(cancellable), FALSE);
+    g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+    gtk_text_buffer_get_bounds(buffer, &start, &end);
+    return rtf_serialize_to_stream(buffer, &start, &end, stream, cancellable, error);
+}
+
 /**
  * rtf_text_buffer_export:
  * @buffer: the text buffer to export
@@ -69,14 +69,43 @@ typedef enum {
  */
 #define RTF_ERROR rtf_error_quark()
 
+/**
+ * RtfImportOptions:
+ *
+ * An opaque structure holding options that control how RTF documents are
+ * imported. Create one with rtf_import_options_new().
+ *
+ * Since: 1.3
+ */
+typedef struct _RtfImportOptions RtfImportOptions;
+
+#define RTF_TYPE_IMPORT_OPTIONS (rtf_import_options_get_type())
+
 GQuark rtf_error_quark(void);
+GType rtf_import_options_get_type(void) G_GNUC_CONST;
+RtfImportOptions *rtf_import_options_new(void);
+RtfImportOptions *rtf_import_options_copy(RtfImportOptions *options);
+void rtf_import_options_free(RtfImportOptions *options);
+void rtf_import_options_set_merge_tags(RtfImportOptions *options, gboolean merge_tags);
+gboolean rtf_import_options_get_merge_tags(RtfImportOptions *options);
+void rtf_import_options_set_lazy_pictures(RtfImportOptions *options, gboolean lazy_pictures);
+gboolean rtf_import_options_get_lazy_pictures(RtfImportOptions *options);
+void rtf_import_options_set_max_picture_pixels(RtfImportOptions *options, guint64 max_pixels);
+guint64 rtf_import_options_get_max_picture_pixels(RtfImportOptions *options);
+void rtf_import_options_set_max_document_pixels(RtfImportOptions *options, guint64 max_pixels);
+guint64 rtf_import_options_get_max_document_pixels(RtfImportOptions *options);
 GdkAtom rtf_register_serialize_format(GtkTextBuffer *buffer);
 GdkAtom rtf_register_deserialize_format(GtkTextBuffer *buffer);
+GdkAtom rtf_register_deserialize_format_with_options(GtkTextBuffer *buffer, RtfImportOptions *options);
 gboolean rtf_text_buffer_import_file(GtkTextBuffer *buffer, GFile *file, GCancellable *cancellable, GError **error);
+gboolean rtf_text_buffer_import_file_with_options(GtkTextBuffer *buffer, GFile *file, RtfImportOptions *options, GCancellable *cancellable, GError **error);
 gboolean rtf_text_buffer_import(GtkTextBuffer *buffer, const gchar *filename, GError **error);
 gboolean rtf_text_buffer_import_from_string(GtkTextBuffer *buffer, const gchar *string, GError **error);
+gboolean rtf_text_buffer_import_from_string_with_options(GtkTextBuffer *buffer, const gchar *string, RtfImportOptions *options, GError **error);
+void rtf_text_buffer_materialize_pictures(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end);
 gboolean rtf_text_buffer_export_file(GtkTextBuffer *buffer, GFile *file, GCancellable *cancellable, GError **error);
 gboolean rtf_text_buffer_export(GtkTextBuffer *buffer, const gchar *filename, GError **error);
+gboolean rtf_text_buffer_export_to_stream(GtkTextBuffer *buffer, GOutputStream *stream, GCancellable *cancellable, GError **error);
 gchar *rtf_text_buffer_export_to_string(GtkTextBuffer *buffer);
 
 G_END_DECLS
@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <gtk/gtk.h>
 #include <osxcart/rtf.h>
@@ -100,6 +102,483 @@ rtf_write_pass_case(gconstpointer name)
 	g_free(string);
 }
 
+/* This test imports an RTF file and exports it both to a string and to a
+memory stream. If the import or the export to the stream fails, the test fails.
+It then compares the RTF code written both ways, apart from the creation time,
+and if they differ, the test fails. Otherwise, the test succeeds. */
+static void
+rtf_write_stream_case(gconstpointer name)
+{
+	GError *error = NULL;
+	GtkTextBuffer *buffer = gtk_text_buffer_new(NULL);
+	GOutputStream *stream = g_memory_output_stream_new(NULL, 0, g_realloc, g_free);
+	gchar *filename = build_filename(name);
+
+	if(!rtf_text_buffer_import(buffer, filename, &error))
+		g_test_message("Import error message: %s", error->message);
+	g_free(filename);
+	g_assert(error == NULL);
+	gchar *string = rtf_text_buffer_export_to_string(buffer);
+	if(!rtf_text_buffer_export_to_stream(buffer, stream, NULL, &error))
+		g_test_message("Export error message: %s", error->message);
+	g_assert(error == NULL);
+	g_assert(g_output_stream_close(stream, NULL, NULL));
+
+	gchar *streamstring = g_strndup(g_memory_output_stream_get_data(G_MEMORY_OUTPUT_STREAM(stream)), g_memory_output_stream_get_data_size(G_MEMORY_OUTPUT_STREAM(stream)));
+	g_assert_cmpuint(strlen(streamstring), ==, strlen(string));
+	/* Skip the header, the creation time may differ */
+	g_assert_cmpstr(strstr(streamstring, "\\deflang"), ==, strstr(string, "\\deflang"));
+
+	g_free(string);
+	g_free(streamstring);
+	g_object_unref(stream);
+	g_object_unref(buffer);
+}
+
+/* Returns whether text with attributes 'a' looks the same as text with
+attributes 'b', as far as the properties that RTF import sets go */
+static gboolean
+text_attributes_equal(GtkTextAttributes *a, GtkTextAttributes *b)
+{
+	return (a->font == b->font || (a->font && b->font && pango_font_description_equal(a->font, b->font)))
+		&& gdk_color_equal(&a->appearance.fg_color, &b->appearance.fg_color)
+		&& gdk_color_equal(&a->appearance.bg_color, &b->appearance.bg_color)
+		&& a->appearance.underline == b->appearance.underline
+		&& a->appearance.strikethrough == b->appearance.strikethrough
+		&& a->appearance.rise == b->appearance.rise
+		&& a->justification == b->justification
+		&& a->direction == b->direction
+		&& a->font_scale == b->font_scale
+		&& a->left_margin == b->left_margin
+		&& a->right_margin == b->right_margin
+		&& a->indent == b->indent
+		&& a->pixels_above_lines == b->pixels_above_lines
+		&& a->pixels_below_lines == b->pixels_below_lines
+		&& a->pixels_inside_wrap == b->pixels_inside_wrap
+		&& a->invisible == b->invisible;
+}
+
+/* Count the tags that have a name; for gtk_text_tag_table_foreach() */
+static void
+count_named_tags(GtkTextTag *tag, gint *count)
+{
+	gchar *name;
+	g_object_get(tag, "name", &name, NULL);
+	if(name != NULL)
+		(*count)++;
+	g_free(name);
+}
+
+/* This test imports an RTF file twice, once normally and once with each run of
+text getting one merged tag. If either import fails, the test fails. It then
+walks through the two GtkTextBuffers, and fails if any character in the second
+buffer has more than one tag, or looks different from the same character in the
+first buffer. It also fails if the second buffer's tag table has any tags with
+a name, which means that the separate tags were created as well, if superscript
+or subscript is lost when exporting the second buffer, or if importing the file
+into it again adds more tags. Otherwise, the test succeeds. */
+static void
+rtf_merge_tags_case(gconstpointer name)
+{
+	GError *error = NULL;
+	GtkTextBuffer *buffer1 = gtk_text_buffer_new(NULL);
+	GtkTextBuffer *buffer2 = gtk_text_buffer_new(NULL);
+	RtfImportOptions *options = rtf_import_options_new();
+	GFile *file;
+	GtkTextIter iter1, iter2;
+	gchar *filename = build_filename(name);
+
+	file = g_file_new_for_path(filename);
+	g_free(filename);
+	if(!rtf_text_buffer_import_file(buffer1, file, NULL, &error))
+		g_test_message("Import error message: %s", error->message);
+	g_assert(error == NULL);
+	rtf_import_options_set_merge_tags(options, TRUE);
+	if(!rtf_text_buffer_import_file_with_options(buffer2, file, options, NULL, &error))
+		g_test_message("Merged import error message: %s", error->message);
+	g_assert(error == NULL);
+
+	g_assert_cmpint(gtk_text_buffer_get_char_count(buffer1), ==, gtk_text_buffer_get_char_count(buffer2));
+	gtk_text_buffer_get_start_iter(buffer1, &iter1);
+	gtk_text_buffer_get_start_iter(buffer2, &iter2);
+	while(!gtk_text_iter_is_end(&iter1))
+	{
+		GtkTextAttributes *values1 = gtk_text_attributes_new();
+		GtkTextAttributes *values2 = gtk_text_attributes_new();
+		GSList *tags = gtk_text_iter_get_tags(&iter2);
+		g_assert_cmpuint(g_slist_length(tags), <=, 1);
+		g_slist_free(tags);
+
+		g_assert_cmpuint(gtk_text_iter_get_char(&iter1), ==, gtk_text_iter_get_char(&iter2));
+		gtk_text_iter_get_attributes(&iter1, values1);
+		gtk_text_iter_get_attributes(&iter2, values2);
+		g_assert(text_attributes_equal(values1, values2));
+		gtk_text_attributes_unref(values1);
+		gtk_text_attributes_unref(values2);
+
+		gtk_text_iter_forward_char(&iter1);
+		gtk_text_iter_forward_char(&iter2);
+	}
+
+	gint namedcount = 0;
+	gtk_text_tag_table_foreach(gtk_text_buffer_get_tag_table(buffer2), (GtkTextTagTableForeach)count_named_tags, &namedcount);
+	g_assert_cmpint(namedcount, ==, 0);
+
+	gchar *string1 = rtf_text_buffer_export_to_string(buffer1);
+	gchar *string2 = rtf_text_buffer_export_to_string(buffer2);
+	g_assert_cmpint(strstr(string1, "\\super") != NULL, ==, strstr(string2, "\\super") != NULL);
+	g_assert_cmpint(strstr(string1, "\\sub") != NULL, ==, strstr(string2, "\\sub") != NULL);
+	g_free(string1);
+	g_free(string2);
+
+	gint tagcount = gtk_text_tag_table_get_size(gtk_text_buffer_get_tag_table(buffer2));
+	if(!rtf_text_buffer_import_file_with_options(buffer2, file, options, NULL, &error))
+		g_test_message("Merged import error message: %s", error->message);
+	g_assert(error == NULL);
+	g_assert_cmpint(gtk_text_tag_table_get_size(gtk_text_buffer_get_tag_table(buffer2)), ==, tagcount);
+	rtf_import_options_free(options);
+	g_object_unref(file);
+
+	g_object_unref(buffer1);
+	g_object_unref(buffer2);
+}
+
+/* This test imports an RTF file twice, once normally and once with lazy
+pictures. If either import fails, the test fails. It then checks that the second
+buffer has a child anchor wherever the first buffer has a picture, and no
+pictures of its own, and that exporting both buffers gives the same RTF code.
+After materializing the pictures in the second buffer, it fails if any character
+or picture in the second buffer is different from the same one in the first
+buffer. Otherwise, the test succeeds. */
+static void
+rtf_lazy_pictures_case(gconstpointer name)
+{
+	GError *error = NULL;
+	GtkTextBuffer *buffer1 = gtk_text_buffer_new(NULL);
+	GtkTextBuffer *buffer2 = gtk_text_buffer_new(NULL);
+	RtfImportOptions *options = rtf_import_options_new();
+	GFile *file;
+	GtkTextIter iter1, iter2;
+	gchar *filename = build_filename(name);
+
+	file = g_file_new_for_path(filename);
+	g_free(filename);
+	if(!rtf_text_buffer_import_file(buffer1, file, NULL, &error))
+		g_test_message("Import error message: %s", error->message);
+	g_assert(error == NULL);
+	rtf_import_options_set_lazy_pictures(options, TRUE);
+	if(!rtf_text_buffer_import_file_with_options(buffer2, file, options, NULL, &error))
+		g_test_message("Lazy import error message: %s", error->message);
+	g_assert(error == NULL);
+	rtf_import_options_free(options);
+	g_object_unref(file);
+
+	g_assert_cmpint(gtk_text_buffer_get_char_count(buffer1), ==, gtk_text_buffer_get_char_count(buffer2));
+	gtk_text_buffer_get_start_iter(buffer1, &iter1);
+	gtk_text_buffer_get_start_iter(buffer2, &iter2);
+	while(!gtk_text_iter_is_end(&iter1))
+	{
+		g_assert(gtk_text_iter_get_pixbuf(&iter2) == NULL);
+		if(gtk_text_iter_get_pixbuf(&iter1))
+			g_assert(gtk_text_iter_get_child_anchor(&iter2) != NULL);
+		gtk_text_iter_forward_char(&iter1);
+		gtk_text_iter_forward_char(&iter2);
+	}
+
+	/* Exporting before materializing must write the same pictures; skip the
+	header, the creation time may differ */
+	gchar *string1 = rtf_text_buffer_export_to_string(buffer1);
+	gchar *string2 = rtf_text_buffer_export_to_string(buffer2);
+	g_assert_cmpstr(strstr(string1, "\\deflang"), ==, strstr(string2, "\\deflang"));
+	g_free(string1);
+	g_free(string2);
+
+	rtf_text_buffer_materialize_pictures(buffer2, NULL, NULL);
+
+	g_assert_cmpint(gtk_text_buffer_get_char_count(buffer1), ==, gtk_text_buffer_get_char_count(buffer2));
+	gtk_text_buffer_get_start_iter(buffer1, &iter1);
+	gtk_text_buffer_get_start_iter(buffer2, &iter2);
+	while(!gtk_text_iter_is_end(&iter1))
+	{
+		GdkPixbuf *pixbuf1 = gtk_text_iter_get_pixbuf(&iter1);
+		GdkPixbuf *pixbuf2 = gtk_text_iter_get_pixbuf(&iter2);
+
+		g_assert_cmpuint(gtk_text_iter_get_char(&iter1), ==, gtk_text_iter_get_char(&iter2));
+		g_assert((pixbuf1 == NULL) == (pixbuf2 == NULL));
+		if(pixbuf1)
+		{
+			g_assert_cmpint(gdk_pixbuf_get_width(pixbuf1), ==, gdk_pixbuf_get_width(pixbuf2));
+			g_assert_cmpint(gdk_pixbuf_get_height(pixbuf1), ==, gdk_pixbuf_get_height(pixbuf2));
+		}
+		gtk_text_iter_forward_char(&iter1);
+		gtk_text_iter_forward_char(&iter2);
+	}
+
+	g_object_unref(buffer1);
+	g_object_unref(buffer2);
+}
+
+/* Convenience function: imports the RTF file 'name' into a new GtkTextBuffer,
+failing the test if the import fails */
+static GtkTextBuffer *
+import_test_file(const gchar *name)
+{
+	GError *error = NULL;
+	GtkTextBuffer *buffer = gtk_text_buffer_new(NULL);
+	gchar *filename = build_filename(name);
+
+	if(!rtf_text_buffer_import(buffer, filename, &error))
+		g_test_message("Import error message: %s", error->message);
+	g_free(filename);
+	g_assert(error == NULL);
+	return buffer;
+}
+
+/* Convenience function: imports the RTF file 'name' into a new GtkTextBuffer
+with 'options', failing the test if the import fails. Warnings about pictures
+that are not loaded because of the options don't fail the test. */
+static GtkTextBuffer *
+import_test_file_with_options(const gchar *name, RtfImportOptions *options)
+{
+	GError *error = NULL;
+	GtkTextBuffer *buffer = gtk_text_buffer_new(NULL);
+	gchar *filename = build_filename(name);
+	GFile *file = g_file_new_for_path(filename);
+	GLogLevelFlags fatal_mask;
+
+	g_free(filename);
+	fatal_mask = g_log_set_always_fatal(G_LOG_FATAL_MASK);
+	if(!rtf_text_buffer_import_file_with_options(buffer, file, options, NULL, &error))
+		g_test_message("Import error message: %s", error->message);
+	g_log_set_always_fatal(fatal_mask);
+	g_object_unref(file);
+	g_assert(error == NULL);
+	return buffer;
+}
+
+/* Convenience function: returns the number of pictures in 'buffer', and stores
+the number of pixels in all of them in 'pixels' */
+static int
+count_pictures(GtkTextBuffer *buffer, int *pixels)
+{
+	GtkTextIter iter;
+	int pictures = 0;
+
+	*pixels = 0;
+	for(gtk_text_buffer_get_start_iter(buffer, &iter); !gtk_text_iter_is_end(&iter); gtk_text_iter_forward_char(&iter))
+	{
+		GdkPixbuf *pixbuf = gtk_text_iter_get_pixbuf(&iter);
+		if(pixbuf)
+		{
+			pictures++;
+			*pixels += gdk_pixbuf_get_width(pixbuf) * gdk_pixbuf_get_height(pixbuf);
+		}
+	}
+	return pictures;
+}
+
+#define TEST_MAX_PICTURE_PIXELS 500
+
+/* This test imports an RTF file with a maximum number of pixels per picture. If
+the import fails, or any picture in the GtkTextBuffer is larger than that, the
+test fails. Otherwise, the test succeeds. */
+static void
+rtf_max_pixels_case(gconstpointer name)
+{
+	RtfImportOptions *options = rtf_import_options_new();
+	GtkTextBuffer *buffer;
+	GtkTextIter iter;
+
+	rtf_import_options_set_max_picture_pixels(options, TEST_MAX_PICTURE_PIXELS);
+	buffer = import_test_file_with_options(name, options);
+	rtf_import_options_free(options);
+
+	for(gtk_text_buffer_get_start_iter(buffer, &iter); !gtk_text_iter_is_end(&iter); gtk_text_iter_forward_char(&iter))
+	{
+		GdkPixbuf *pixbuf = gtk_text_iter_get_pixbuf(&iter);
+		if(pixbuf)
+			g_assert_cmpint(gdk_pixbuf_get_width(pixbuf) * gdk_pixbuf_get_height(pixbuf), <=, TEST_MAX_PICTURE_PIXELS);
+	}
+
+	g_object_unref(buffer);
+}
+
+/* This test imports an RTF file with a PNG picture that is shown small, but is
+much larger than the maximum number of pixels per picture. The PNG loader can
+only decode it at its real size, so the test fails if the picture is in the
+GtkTextBuffer, or if the text around it is not. Otherwise, the test succeeds. */
+static void
+rtf_large_picture_case(gconstpointer name)
+{
+	RtfImportOptions *options = rtf_import_options_new();
+	GtkTextBuffer *buffer;
+	GtkTextIter start, end;
+	int pixels;
+
+	rtf_import_options_set_max_picture_pixels(options, TEST_MAX_PICTURE_PIXELS);
+	buffer = import_test_file_with_options(name, options);
+	rtf_import_options_free(options);
+
+	g_assert_cmpint(count_pictures(buffer, &pixels), ==, 0);
+	gtk_text_buffer_get_bounds(buffer, &start, &end);
+	gchar *text = gtk_text_buffer_get_text(buffer, &start, &end, TRUE);
+	g_assert(strstr(text, "Picture too large to load:  done.") != NULL);
+
+	g_free(text);
+	g_object_unref(buffer);
+}
+
+#define TEST_MAX_DOCUMENT_PIXELS 10
+
+/* This test imports an RTF file with three pictures of 2 by 2 pixels, with a
+maximum number of pixels in the whole document that only two of them fit into.
+If the GtkTextBuffer does not contain exactly two pictures, or they are larger
+than the maximum together, the test fails. Otherwise, the test succeeds. */
+static void
+rtf_max_document_pixels_case(gconstpointer name)
+{
+	RtfImportOptions *options = rtf_import_options_new();
+	GtkTextBuffer *buffer;
+	int pixels;
+
+	rtf_import_options_set_max_document_pixels(options, TEST_MAX_DOCUMENT_PIXELS);
+	buffer = import_test_file_with_options(name, options);
+	rtf_import_options_free(options);
+
+	g_assert_cmpint(count_pictures(buffer, &pixels), ==, 2);
+	g_assert_cmpint(pixels, <=, TEST_MAX_DOCUMENT_PIXELS);
+
+	g_object_unref(buffer);
+}
+
+/* This test imports an RTF file with ignored destinations containing braces,
+escapes, and binary data. It fails if any text from inside the ignored
+destinations ends up in the GtkTextBuffer, or if the text around them does not.
+Otherwise, the test succeeds. */
+static void
+rtf_ignored_destinations_case(gconstpointer name)
+{
+	GtkTextBuffer *buffer = import_test_file(name);
+	GtkTextIter start, end;
+
+	gtk_text_buffer_get_bounds(buffer, &start, &end);
+	gchar *text = gtk_text_buffer_get_text(buffer, &start, &end, TRUE);
+	g_assert(strstr(text, "Text before  and text after.") != NULL);
+	g_assert(strstr(text, "Skipped") == NULL);
+	g_assert(strstr(text, "nested") == NULL);
+	g_assert(strstr(text, "more") == NULL);
+	g_assert(strchr(text, '{') == NULL);
+	g_assert(strchr(text, '}') == NULL);
+	g_assert(strchr(text, '\\') == NULL);
+
+	g_free(text);
+	g_object_unref(buffer);
+}
+
+/* This test imports an RTF file with a picture given as binary data, and binary
+data outside of a picture. It fails if the picture is not in the GtkTextBuffer,
+or if any of the other binary data ends up in it as text. Otherwise, the test
+succeeds. */
+static void
+rtf_binary_data_case(gconstpointer name)
+{
+	GtkTextBuffer *buffer = import_test_file(name);
+	GtkTextIter start, end, iter;
+	int pictures = 0;
+
+	gtk_text_buffer_get_bounds(buffer, &start, &end);
+	for(iter = start; !gtk_text_iter_is_end(&iter); gtk_text_iter_forward_char(&iter))
+		if(gtk_text_iter_get_pixbuf(&iter))
+			pictures++;
+	g_assert_cmpint(pictures, ==, 1);
+
+	gchar *text = gtk_text_buffer_get_text(buffer, &start, &end, TRUE);
+	g_assert(strstr(text, "and binary data to skip:  done.") != NULL);
+	g_assert(strchr(text, '{') == NULL);
+	g_assert(strchr(text, '}') == NULL);
+	g_assert(strchr(text, '\\') == NULL);
+
+	g_free(text);
+	g_object_unref(buffer);
+}
+
+/* This test imports an RTF file with nested groups that share the state of the
+enclosing group, containing only control words that don't change it, such as
+\u and \par, and groups that do change it, such as with \uc. If the text
+in the GtkTextBuffer is wrong, the test fails. Otherwise, the test succeeds. */
+static void
+rtf_shared_states_case(gconstpointer name)
+{
+	GtkTextBuffer *buffer = import_test_file(name);
+	GtkTextIter start, end;
+
+	gtk_text_buffer_get_bounds(buffer, &start, &end);
+	gchar *text = gtk_text_buffer_get_text(buffer, &start, &end, TRUE);
+	g_assert(g_str_has_prefix(text, "\xE2\x82\xAC\n\xE2\x82\xAC\xE2\x82\xAC\xE2\x82\xAC" "bold\xE2\x82\xAC"));
+
+	g_free(text);
+	g_object_unref(buffer);
+}
+
+/* This test exports an RTF file to a GOutputStream with a GCancellable that is
+already cancelled. If the export does not fail with G_IO_ERROR_CANCELLED, or
+writes anything to the stream, the test fails. Otherwise, the test succeeds. */
+static void
+rtf_cancelled_stream_case(gconstpointer name)
+{
+	GError *error = NULL;
+	GtkTextBuffer *buffer = import_test_file(name);
+	GOutputStream *stream = g_memory_output_stream_new(NULL, 0, g_realloc, g_free);
+	GCancellable *cancellable = g_cancellable_new();
+
+	g_cancellable_cancel(cancellable);
+	g_assert(!rtf_text_buffer_export_to_stream(buffer, stream, cancellable, &error));
+	g_assert(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED));
+	g_assert_cmpuint(g_memory_output_stream_get_data_size(G_MEMORY_OUTPUT_STREAM(stream)), ==, 0);
+
+	g_error_free(error);
+	g_object_unref(cancellable);
+	g_object_unref(stream);
+	g_object_unref(buffer);
+}
+
+#define TEST_ORIGINAL_CONTENTS "Original contents\n"
+
+/* This test exports an RTF file over an existing file with a GCancellable that
+is already cancelled. If the export does not fail with G_IO_ERROR_CANCELLED, or
+the existing file's contents change, the test fails. Otherwise, the test
+succeeds. */
+static void
+rtf_cancelled_file_case(gconstpointer name)
+{
+	GError *error = NULL;
+	GtkTextBuffer *buffer = import_test_file(name);
+	GCancellable *cancellable = g_cancellable_new();
+	gchar *filename, *contents;
+	GFile *file;
+	int fd;
+
+	fd = g_file_open_tmp("osxcart-test-XXXXXX.rtf", &filename, &error);
+	g_assert(error == NULL);
+	close(fd);
+	g_assert(g_file_set_contents(filename, TEST_ORIGINAL_CONTENTS, -1, NULL));
+	file = g_file_new_for_path(filename);
+
+	g_cancellable_cancel(cancellable);
+	g_assert(!rtf_text_buffer_export_file(buffer, file, cancellable, &error));
+	g_assert(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED));
+	g_assert(g_file_get_contents(filename, &contents, NULL, NULL));
+	g_assert_cmpstr(contents, ==, TEST_ORIGINAL_CONTENTS);
+
+	g_unlink(filename);
+	g_free(contents);
+	g_free(filename);
+	g_error_free(error);
+	g_object_unref(file);
+	g_object_unref(cancellable);
+	g_object_unref(buffer);
+}
+
 static void
 yes_clicked(GtkButton *button, gboolean *was_correct)
 {
@@ -310,6 +789,9 @@ const gchar *codeprojectfailcases[] = {
 
 const char *variouspasscases[] = {
 	"Character scaling", "charscalex.rtf",
+	"Skipping ignored destinations", "ignored_destinations.rtf",
+	"Binary data", "binary_data.rtf",
+	"Shared group states", "shared_states.rtf",
 	NULL, NULL
 };
 
@@ -382,6 +864,29 @@ add_rtf_tests(void)
 	add_tests(rtfbookexamples, "/rtf/write/", rtf_write_pass_case);
 	add_tests(codeprojectpasscases, "/rtf/write/", rtf_write_pass_case);
 	add_tests(variouspasscases, "/rtf/write/", rtf_write_pass_case);
+	/* These tests export the RTF to a stream and compare it to the string */
+	add_tests(rtfbookexamples, "/rtf/stream/", rtf_write_stream_case);
+	add_tests(codeprojectpasscases, "/rtf/stream/", rtf_write_stream_case);
+	add_tests(variouspasscases, "/rtf/stream/", rtf_write_stream_case);
+	g_test_add_data_func("/rtf/stream/Cancelled stream", "charscalex.rtf", rtf_cancelled_stream_case);
+	g_test_add_data_func("/rtf/stream/Cancelled file", "charscalex.rtf", rtf_cancelled_file_case);
+	/* These tests import the RTF with merged tags and compare the formatting */
+	add_tests(rtfbookexamples, "/rtf/merge/", rtf_merge_tags_case);
+	add_tests(codeprojectpasscases, "/rtf/merge/", rtf_merge_tags_case);
+	/* These tests import the RTF with lazy pictures and compare the pictures */
+	add_tests(rtfbookexamples, "/rtf/lazy/", rtf_lazy_pictures_case);
+	add_tests(codeprojectpasscases, "/rtf/lazy/", rtf_lazy_pictures_case);
+	add_tests(variouspasscases, "/rtf/lazy/", rtf_lazy_pictures_case);
+	/* These tests import the RTF with a limit on the size of pictures */
+	add_tests(rtfbookexamples, "/rtf/maxpixels/", rtf_max_pixels_case);
+	add_tests(codeprojectpasscases, "/rtf/maxpixels/", rtf_max_pixels_case);
+	g_test_add_data_func("/rtf/maxpixels/Large picture", "large_picture.rtf", rtf_large_picture_case);
+	g_test_add_data_func("/rtf/maxpixels/Document pixels", "document_pixels.rtf", rtf_max_document_pixels_case);
+	/* These tests check what is skipped in particular files */
+	g_test_add_data_func("/rtf/skip/Skipping ignored destinations", "ignored_destinations.rtf", rtf_ignored_destinations_case);
+	g_test_add_data_func("/rtf/skip/Binary data", "binary_data.rtf", rtf_binary_data_case);
+	/* This test checks the text of nested groups that share their state */
+	g_test_add_data_func("/rtf/parse/Shared group states", "shared_states.rtf", rtf_shared_states_case);
     /* RTFD tests */
     g_test_add_data_func("/rtf/parse/pass/RTFD test", "rtfdtest.rtfd", rtf_parse_pass_case);
     g_test_add_data_func("/rtf/write/RTFD test", "rtfdtest.rtfd", rtf_write_pass_case);